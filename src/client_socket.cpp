@@ -10,6 +10,14 @@
  *          send_rev
  *          _validate_client
  *          _track_client
+ *          _process_norm
+ *          _process_rev
+ *          _complete_call
+ *          _fail_norm
+ *          _send_norm
+ *          _send_rev
+ *          _flush_outbound
+ *          _wakeup
  *          _recv_norm_step
  *          _recv_rev_step
  *          add_metadata
@@ -32,7 +40,7 @@
 
 namespace nrpc_cpp {
 
-ClientSocket::ClientSocket(std::string ip_address, int port, int port_rev, std::string socket_name) {
+ClientSocket::ClientSocket(std::string ip_address, int port, int port_rev, std::string socket_name, void* zmq_context) {
     client_id_ = 0;
     ip_address_ = ip_address;
     port_ = port;
@@ -46,6 +54,8 @@ ClientSocket::ClientSocket(std::string ip_address, int port, int port_rev, std::
     is_connected_ = false;
     is_validated_ = false;
     is_lost_ = false;
+    // No reverse port, reverse requests arrive on the main connection tagged with ServerMessage::Reverse
+    is_multiplexed_ = port_rev == 0;
 
     char hostname[1024];
     hostname[0] = 0;
@@ -77,67 +87,69 @@ ClientSocket::ClientSocket(std::string ip_address, int port, int port_rev, std::
     };
 
     server_metadata_ = {};
-    zmq_context_ = 0;
+    zmq_context_ = zmq_context;
     zmq_client_ = 0;
     zmq_client_rev_ = 0;
     zmq_monitor_ = 0;
+    zmq_wakeup_ = 0;
+    zmq_wakeup_send_ = 0;
     zmq_monitor_thread_ = 0;
+    zmq_io_thread_ = 0;
+    next_call_id_ = 0;
 }
 
 void ClientSocket::connect() {
     assert(!is_validated_);
-
-    zmq_context_ = zmq_ctx_new();
+    assert(zmq_context_);
 
     zmq_client_ = zmq_socket(zmq_context_, ZMQ_ROUTER);
     assert(zmq_client_);
 
-    auto rc = zmq_connect(zmq_client_, boost::str(boost::format("tcp://%1%:%2%") % ip_address_ % port_).c_str());
+    // Wakes up the I/O thread when callers queue outgoing requests, see send_norm
+    auto wakeup_addr = get_inproc_address("wakeup-client");
+    int wakeup_linger = 0;
+    zmq_wakeup_ = zmq_socket(zmq_context_, ZMQ_PULL);
+    auto rc = zmq_bind(zmq_wakeup_, wakeup_addr.c_str());
+    assert(rc == 0);
+    zmq_wakeup_send_ = zmq_socket(zmq_context_, ZMQ_PUSH);
+    zmq_setsockopt(zmq_wakeup_send_, ZMQ_LINGER, &wakeup_linger, sizeof(wakeup_linger));
+    rc = zmq_connect(zmq_wakeup_send_, wakeup_addr.c_str());
     assert(rc == 0);
 
-    rc = zmq_socket_monitor(zmq_client_, "inproc://monitor-client", ZMQ_EVENT_ALL);
+    // Monitor is attached before connecting so the handshake event can't be missed
+    auto monitor_addr = get_inproc_address("monitor-client");
+    rc = zmq_socket_monitor(zmq_client_, monitor_addr.c_str(), ZMQ_EVENT_ALL);
     assert(rc == 0);
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
     zmq_monitor_ = zmq_socket(zmq_context_, ZMQ_PAIR);
     assert(zmq_monitor_);
-    rc = zmq_connect(zmq_monitor_, "inproc://monitor-client");
+    rc = zmq_connect(zmq_monitor_, monitor_addr.c_str());
     assert(rc == 0);
     int linger = 0;
     zmq_setsockopt(zmq_monitor_, ZMQ_LINGER, &linger, sizeof(linger));
     zmq_monitor_thread_ = std::make_shared<std::thread>([this]() { _track_client(); });
 
-    while (!is_connected_) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    rc = zmq_connect(zmq_client_, boost::str(boost::format("tcp://%1%:%2%") % ip_address_ % port_).c_str());
+    assert(rc == 0);
+
+    {
+        std::unique_lock<std::mutex> lock(connected_lock_);
+        // Closing or losing the socket ends the wait, e.g. while the server is unreachable
+        connected_changed_.wait(lock, [this]() { return is_connected_ || !is_alive_ || is_lost_; });
+        if (!is_connected_) {
+            return;
+        }
     }
 
-    std::vector<std::vector<uint8_t>> resp;
+    std::vector<MessageFrame> resp;
     {
         std::lock_guard<std::recursive_mutex> lock(request_lock_);
-        zmq_msg_t msg;
         auto part0 = server_signature_;
         auto part1 = ServerMessage::AddClient;
         auto part2 = get_buffer_json(metadata_);
 
-        auto rc = zmq_msg_init_size(&msg, part0.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-        rc = zmq_msg_send(&msg, zmq_client_, ZMQ_SNDMORE);
-        assert(rc == part0.size());
-        zmq_msg_close(&msg);
-
-        rc = zmq_msg_init_size(&msg, part1.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-        rc = zmq_msg_send(&msg, zmq_client_, ZMQ_SNDMORE);
-        assert(rc == part1.size());
-        zmq_msg_close(&msg);
-
-        rc = zmq_msg_init_size(&msg, part2.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-        rc = zmq_msg_send(&msg, zmq_client_, 0);
-        assert(rc == part2.size());
-        zmq_msg_close(&msg);
+        send_buffer_copy(zmq_client_, part0, ZMQ_SNDMORE);
+        send_buffer(zmq_client_, part1, ZMQ_SNDMORE);
+        send_buffer(zmq_client_, part2, 0);
 
         while (is_alive_ && !is_lost_) {
             _recv_norm_step(resp);
@@ -147,6 +159,9 @@ void ClientSocket::connect() {
             break;
         }
     }
+    if (!resp.size()) {
+        return;
+    }
 
     assert(resp[1] == ServerMessage::ClientAdded);
     auto resp2 = get_json(resp[2]);
@@ -158,6 +173,14 @@ void ClientSocket::connect() {
     metadata_["client_signature"] = base64_encode(client_signature_);
     metadata_["client_signature_rev"] = base64_encode(client_signature_rev_);
 
+    if (is_multiplexed_) {
+        // Server validates the client together with ClientAdded, there is no reverse connection to check
+        server_metadata_ = (nlohmann::json)resp2["server_metadata"];
+        is_validated_ = true;
+        zmq_io_thread_ = std::make_shared<std::thread>([this]() { _process_norm(); });
+        return;
+    }
+
     zmq_client_rev_ = zmq_socket(zmq_context_, ZMQ_ROUTER);
 
     rc = zmq_setsockopt(zmq_client_rev_, ZMQ_IDENTITY, &client_signature_rev_[0], client_signature_rev_.size());
@@ -165,10 +188,15 @@ void ClientSocket::connect() {
     rc = zmq_connect(zmq_client_rev_, boost::str(boost::format("tcp://%1%:%2%") % ip_address_ % port_rev_).c_str());
     assert(rc == 0);
 
-    std::vector<std::vector<uint8_t>> req;
+    std::vector<MessageFrame> req;
     while (is_alive_ && !is_lost_) {
-        _recv_rev_step(req);
-        if (!req.size()) {
+        zmq_pollitem_t pollitems[2] = {0};
+        pollitems[0].socket = zmq_client_rev_;
+        pollitems[0].events = ZMQ_POLLIN;
+        pollitems[1].socket = zmq_wakeup_;
+        pollitems[1].events = ZMQ_POLLIN;
+        zmq_poll(pollitems, 2, -1);
+        if (!_recv_rev_step(req)) {
             continue;
         }
 
@@ -179,165 +207,118 @@ void ClientSocket::connect() {
             std::cerr << "Early message on client side!" << std::endl;
             auto method_name = get_string(req[1]);
             auto part0 = server_signature_rev_;
-            auto part1 = boost::str(boost::format("message_dropped:%1%") % method_name);
+            auto part1 = get_buffer(boost::str(boost::format("message_dropped:%1%") % method_name));
             auto part2 = get_buffer_json({{"error", "Early message dropped"}});
 
-            zmq_msg_t msg;
-            auto rc = zmq_msg_init_size(&msg, part0.size());
-            assert(rc == 0);
-            memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-            rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-            assert(rc == part0.size());
-            zmq_msg_close(&msg);
-
-            rc = zmq_msg_init_size(&msg, part1.size());
-            assert(rc == 0);
-            memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-            rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-            assert(rc == part1.size());
-            zmq_msg_close(&msg);
-
-            rc = zmq_msg_init_size(&msg, part2.size());
-            assert(rc == 0);
-            memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-            rc = zmq_msg_send(&msg, zmq_client_rev_, 0);
-            assert(rc == part2.size());
-            zmq_msg_close(&msg);
+            send_buffer_copy(zmq_client_rev_, part0, ZMQ_SNDMORE);
+            send_buffer(zmq_client_rev_, part1, ZMQ_SNDMORE);
+            send_buffer(zmq_client_rev_, part2, 0);
         }
     }
 
-    assert(is_validated_);
+    if (!is_validated_) {
+        // Closed or lost before the server validated the reverse connection
+        return;
+    }
+
+    // From here on zmq_client_ is owned by the I/O thread
+    zmq_io_thread_ = std::make_shared<std::thread>([this]() { _process_norm(); });
 }
 
-void ClientSocket::send_norm(std::vector<std::vector<uint8_t>>& request) {
-    assert(zmq_client_rev_);
+uint32_t ClientSocket::send_norm(std::vector<std::vector<uint8_t>>& request,
+                                 std::function<void(std::vector<uint8_t>&)> callback) {
+    assert(zmq_client_rev_ || is_multiplexed_);
     assert(client_id_);
     assert(is_validated_);
     assert(request.size() == 2);
-    auto part0 = server_signature_;
-    auto part1 = request[0];
-    auto part2 = request[1];
-
-    zmq_msg_t msg;
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_client_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_client_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
 
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_client_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    uint32_t call_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        next_call_id_ += 1;
+        if (next_call_id_ == 0) {
+            next_call_id_ = 1;
+        }
+        call_id = next_call_id_;
+        {
+            std::lock_guard<std::mutex> lock2(pending_lock_);
+            auto call = std::make_shared<PendingCallInfo>();
+            call->call_id = call_id;
+            call->callback = callback;
+            pending_calls_[call_id] = call;
+        }
+        outbound_norm_.push_back({});
+        outbound_norm_.back().swap(request);
+        outbound_norm_.back().push_back(get_buffer_call_id(call_id));
+        _wakeup();
+    }
+    if (is_lost_) {
+        // Registered after the server was lost, nothing will answer
+        _fail_norm();
+    }
+    return call_id;
 }
 
-bool ClientSocket::recv_norm(std::vector<uint8_t>& response) {
-    std::vector<std::vector<uint8_t>> resp;
-    while (is_alive_) {
-        _recv_norm_step(resp);
-        if (!resp.size()) {
-            continue;
-        }
-        break;
+bool ClientSocket::recv_norm(uint32_t call_id, std::vector<uint8_t>& response) {
+    std::unique_lock<std::mutex> lock(pending_lock_);
+    auto found = pending_calls_.find(call_id);
+    assert(found != pending_calls_.end());
+    auto call = found->second;
+    assert(!call->callback);
+    call->ready.wait(lock, [this, &call]() { return call->is_done || !is_alive_ || is_lost_; });
+    pending_calls_.erase(call_id);
+    if (pending_calls_.empty()) {
+        pending_empty_.notify_all();
     }
-    if (!is_alive_) {
+    if (!call->response.size()) {
         return false;
     }
-    assert(resp.size());
-    response = resp[2];
-    assert(response[0] == (uint8_t)'{');
+    response.swap(call->response);
+    assert(response[0] == (uint8_t)'{' || is_binary_buffer(response));
     return true;
 }
 
-bool ClientSocket::recv_rev(std::vector<std::vector<uint8_t>>& request, int timeout_ms) {
+bool ClientSocket::recv_rev(std::vector<MessageFrame>& request, int timeout_ms) {
     request.resize(0);
-    std::vector<std::vector<uint8_t>> req;
-
     if (!is_validated_) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        if (!is_validated_) {
-            return false;
-        }
-    }
-
-    auto started = std::chrono::steady_clock::now();
-    auto found = false;
-
-    while (is_alive_ && !is_lost_) {
-        auto elapsed_ms =
-            timeout_ms > 0 ? std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started)
-                .count() : 0;
-        if (timeout_ms > 0 && elapsed_ms > timeout_ms) {
-            break;
-        }
-        _recv_rev_step(req);
-        if (!req.size()) {
-            continue;
-        }
-
-        if (req[1] == ServerMessage::ValidateClient) {
-            _validate_client(req);
-        } else {
-            break;
-        }
+        return false;
     }
 
-    if (!(is_alive_ && !is_lost_)) {
-        return false;
+    // Requests are read by the I/O thread, see _process_rev
+    std::unique_lock<std::mutex> lock(inbound_lock_);
+    auto ready = [this]() { return !is_alive_ || is_lost_ || inbound_rev_.size(); };
+    if (timeout_ms > 0) {
+        inbound_ready_.wait_for(lock, std::chrono::milliseconds(timeout_ms), ready);
+    } else {
+        inbound_ready_.wait(lock, ready);
     }
-    if (!req.size()) {
+    if (!is_alive_ || !inbound_rev_.size()) {
         return false;
     }
 
-    request.resize(2);
-    request[0] = req[1];
-    request[1] = req[2];
+    auto req = std::move(inbound_rev_.front());
+    inbound_rev_.pop_front();
+    request.resize(req.size() - 1);
+    request[0] = std::move(req[1]);
+    request[1] = std::move(req[2]);
+    if (req.size() == 4) {
+        request[2] = std::move(req[3]);
+    }
     return true;
 }
 
 void ClientSocket::send_rev(std::vector<std::vector<uint8_t>>& response) {
-    assert(zmq_client_rev_);
+    assert(zmq_client_rev_ || is_multiplexed_);
     assert(client_id_);
     assert(is_validated_);
-    assert(response.size() == 2);
-    auto part0 = server_signature_rev_;
-    auto part1 = response[0];
-    auto part2 = response[1];
-
-    zmq_msg_t msg;
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    assert(response.size() == 2 || response.size() == 3);
+    std::lock_guard<std::mutex> lock(outbound_lock_);
+    outbound_rev_.push_back({});
+    outbound_rev_.back().swap(response);
+    _wakeup();
 }
 
-void ClientSocket::_validate_client(std::vector<std::vector<uint8_t>>& req) {
+void ClientSocket::_validate_client(std::vector<MessageFrame>& req) {
     assert(req[0] == server_signature_rev_);
     auto req2 = get_json(req[2]);
     assert(client_id_ == (int)req2["client_id"]);
@@ -349,44 +330,30 @@ void ClientSocket::_validate_client(std::vector<std::vector<uint8_t>>& req) {
     auto part1 = ServerMessage::ClientValidated;
     auto part2 = get_buffer_json(metadata_);
 
-    zmq_msg_t msg;
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_client_rev_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    send_buffer_copy(zmq_client_rev_, part0, ZMQ_SNDMORE);
+    send_buffer(zmq_client_rev_, part1, ZMQ_SNDMORE);
+    send_buffer(zmq_client_rev_, part2, 0);
 
     is_validated_ = true;
 }
 
 void ClientSocket::_track_client() {
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
     assert(zmq_monitor_);
     std::vector<std::vector<uint8_t>> resp;
 
     while (is_alive_) {
+        // Events are handled as they arrive, close stops the monitor which sends ZMQ_EVENT_MONITOR_STOPPED
+        zmq_pollitem_t pollitems[1] = {0};
+        pollitems[0].socket = zmq_monitor_;
+        pollitems[0].events = ZMQ_POLLIN;
+        zmq_poll(pollitems, 1, -1);
+
         zmq_msg_t msg;
         zmq_msg_init(&msg);
         auto rc = zmq_msg_recv(&msg, zmq_monitor_, ZMQ_DONTWAIT);
         if (rc == -1) {
             assert(zmq_errno() == EAGAIN);
             zmq_msg_close(&msg);
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
             continue;
         }
 
@@ -409,10 +376,25 @@ void ClientSocket::_track_client() {
 
         if (event_id == ZMQ_EVENT_CONNECTED) {
         } else if (event_id == ZMQ_EVENT_HANDSHAKE_SUCCEEDED) {
+            std::lock_guard<std::mutex> lock(connected_lock_);
             is_connected_ = true;
+            connected_changed_.notify_all();
         } else if (event_id == ZMQ_EVENT_DISCONNECTED) {
-            is_lost_ = true;
+            {
+                std::lock_guard<std::mutex> lock(connected_lock_);
+                is_lost_ = true;
+                connected_changed_.notify_all();
+            }
             client_errors_ += boost::str(boost::format("\nConnection lost %1%") % event_value);
+            {
+                std::lock_guard<std::mutex> lock(outbound_lock_);
+                _wakeup();
+            }
+            {
+                std::lock_guard<std::mutex> lock(inbound_lock_);
+                inbound_ready_.notify_all();
+            }
+            _fail_norm();
         }
 
         resp.resize(0);
@@ -428,43 +410,194 @@ void ClientSocket::_track_client() {
     // std::cout << "MON EXITED" << std::endl;
 }
 
-bool ClientSocket::_recv_norm_step(std::vector<std::vector<uint8_t>>& response) {
-    auto ready = false;
-    auto ready_timeout = false;
-    response.resize(0);
-    zmq_msg_t msg;
-
+void ClientSocket::_process_norm() {
+    std::vector<MessageFrame> resp;
     while (is_alive_) {
-        auto timeout_ms = 100;
-        zmq_setsockopt(zmq_client_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
-        auto rc = zmq_msg_init(&msg);
-        assert(rc == 0);
-        rc = zmq_msg_recv(&msg, zmq_client_, 0);
-        if (rc == -1) {
-            ready_timeout = true;
-            assert(zmq_errno() == EAGAIN);
+        _recv_norm_step(resp);
+        if (!resp.size()) {
+            continue;
         }
-        if (!is_alive_) {
-            zmq_msg_close(&msg);
-            break;
+
+        // Responses without a call id come from peers that answer in order
+        auto call_id = resp.size() == 4 ? get_call_id(resp[3]) : 0;
+        std::shared_ptr<PendingCallInfo> call;
+        {
+            std::lock_guard<std::mutex> lock(pending_lock_);
+            auto found = pending_calls_.end();
+            if (call_id) {
+                found = pending_calls_.find(call_id);
+            } else {
+                found = std::find_if(pending_calls_.begin(), pending_calls_.end(),
+                                     [](auto& x) { return !x.second->is_done; });
+            }
+            if (found == pending_calls_.end()) {
+                std::cerr << "Unexpected response dropped! " << get_method_label(resp[1]) << std::endl;
+                continue;
+            }
+            call = found->second;
+            if (call->callback) {
+                pending_calls_.erase(found);
+                if (pending_calls_.empty()) {
+                    pending_empty_.notify_all();
+                }
+            }
         }
-        timeout_ms = -1;
-        zmq_setsockopt(zmq_client_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+        auto response = resp[2].get_buffer();
+        _complete_call(call, response);
+    }
+}
 
-        if (!is_alive_) {
-            zmq_msg_close(&msg);
-            break;
+void ClientSocket::_process_rev() {
+    std::vector<MessageFrame> req;
+    while (_recv_rev_step(req)) {
+        if (req[1] == ServerMessage::ValidateClient) {
+            _validate_client(req);
+            continue;
         }
-        if (ready_timeout) {
-            zmq_msg_close(&msg);
+        std::lock_guard<std::mutex> lock(inbound_lock_);
+        inbound_rev_.push_back(std::move(req));
+        inbound_ready_.notify_one();
+    }
+}
+
+void ClientSocket::_complete_call(std::shared_ptr<PendingCallInfo> call, std::vector<uint8_t>& response) {
+    if (call->callback) {
+        // Callbacks run on the I/O thread, one that throws must not end it
+        try {
+            call->callback(response);
+        } catch (const std::exception& e) {
+            std::cerr << "Call callback failed! " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "Call callback failed!" << std::endl;
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pending_lock_);
+    call->response.swap(response);
+    call->is_done = true;
+    call->ready.notify_all();
+}
+
+// Completes outstanding calls with an empty response once the server is lost, see ServerSocket::_fail_rev
+void ClientSocket::_fail_norm() {
+    std::vector<std::shared_ptr<PendingCallInfo>> failed;
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        for (auto it = pending_calls_.begin(); it != pending_calls_.end();) {
+            auto call = it->second;
+            if (call->is_done) {
+                ++it;
+                continue;
+            }
+            failed.push_back(call);
+            it = call->callback ? pending_calls_.erase(it) : std::next(it);
+        }
+        pending_empty_.notify_all();
+    }
+    for (auto& call : failed) {
+        std::vector<uint8_t> empty;
+        _complete_call(call, empty);
+    }
+}
+
+void ClientSocket::_send_norm(std::vector<std::vector<uint8_t>>& request) {
+    assert(request.size() == 3);
+    auto& part0 = server_signature_;
+    auto& part1 = request[0];
+    auto& part2 = request[1];
+    auto& part3 = request[2];
+
+    send_buffer_copy(zmq_client_, part0, ZMQ_SNDMORE);
+    send_buffer(zmq_client_, part1, ZMQ_SNDMORE);
+    send_buffer(zmq_client_, part2, ZMQ_SNDMORE);
+    send_buffer(zmq_client_, part3, 0);
+}
+
+void ClientSocket::_send_rev(std::vector<std::vector<uint8_t>>& response) {
+    assert(response.size() == 2 || response.size() == 3);
+    auto socket = is_multiplexed_ ? zmq_client_ : zmq_client_rev_;
+    auto& part0 = is_multiplexed_ ? server_signature_ : server_signature_rev_;
+    auto& part1 = response[0];
+    auto& part2 = response[1];
+    auto has_call_id = response.size() == 3;
+
+    send_buffer_copy(socket, part0, ZMQ_SNDMORE);
+    if (is_multiplexed_) {
+        send_buffer_copy(socket, ServerMessage::Reverse, ZMQ_SNDMORE);
+    }
+    send_buffer(socket, part1, ZMQ_SNDMORE);
+    send_buffer(socket, part2, has_call_id ? ZMQ_SNDMORE : 0);
+
+    if (has_call_id) {
+        auto& part3 = response[2];
+        send_buffer(socket, part3, 0);
+    }
+}
+
+void ClientSocket::_flush_outbound() {
+    std::deque<std::vector<std::vector<uint8_t>>> outbound;
+    std::deque<std::vector<std::vector<uint8_t>>> outbound_rev;
+    {
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        uint8_t signal[64];
+        while (zmq_recv(zmq_wakeup_, signal, sizeof(signal), ZMQ_DONTWAIT) != -1) {
+        }
+        outbound.swap(outbound_norm_);
+        outbound_rev.swap(outbound_rev_);
+    }
+    for (auto& item : outbound) {
+        _send_norm(item);
+    }
+    for (auto& item : outbound_rev) {
+        _send_rev(item);
+    }
+}
+
+// Wakeup message is only a signal, a full queue means the I/O thread is already awake.
+// The PUSH socket is shared by caller threads, outbound_lock_ must be held.
+void ClientSocket::_wakeup() {
+    if (!zmq_wakeup_send_) {
+        return;
+    }
+    uint8_t signal = 1;
+    zmq_send(zmq_wakeup_send_, &signal, 1, ZMQ_DONTWAIT);
+}
+
+bool ClientSocket::_recv_norm_step(std::vector<MessageFrame>& response) {
+    auto ready = false;
+    response.resize(0);
+
+    // Reverse requests are served here too once the client is validated, shutdown and
+    // disconnects arrive through the wakeup socket so there is no polling timeout
+    zmq_pollitem_t pollitems[3] = {0};
+    pollitems[0].socket = zmq_client_;
+    pollitems[0].events = ZMQ_POLLIN;
+    pollitems[1].socket = zmq_wakeup_;
+    pollitems[1].events = ZMQ_POLLIN;
+    pollitems[2].socket = zmq_client_rev_;
+    pollitems[2].events = ZMQ_POLLIN;
+    auto poll_count = zmq_client_rev_ && is_validated_ ? 3 : 2;
+    zmq_poll(pollitems, poll_count, -1);
+
+    if (pollitems[1].revents & ZMQ_POLLIN) {
+        _flush_outbound();
+    }
+    if (pollitems[2].revents & ZMQ_POLLIN) {
+        _process_rev();
+    }
+    if (!(pollitems[0].revents & ZMQ_POLLIN)) {
+        return false;
+    }
+
+    while (is_alive_) {
+        norm_messages_.emplace_back();
+        if (!norm_messages_.back().recv(zmq_client_, ZMQ_DONTWAIT)) {
+            assert(zmq_errno() == EAGAIN);
+            norm_messages_.pop_back();
             break;
         }
 
-        norm_messages_.resize(norm_messages_.size() + 1);
-        set_buffer(norm_messages_.back(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-        auto ready_last = !zmq_msg_more(&msg);
-        zmq_msg_close(&msg);
-        if (ready_last) {
+        if (!norm_messages_.back().more()) {
             ready = true;
             break;
         }
@@ -474,50 +607,35 @@ bool ClientSocket::_recv_norm_step(std::vector<std::vector<uint8_t>>& response)
         return false;
     }
 
-    response = norm_messages_;
+    response.swap(norm_messages_);
     norm_messages_.clear();
-    assert(response.size() == 3);
     assert(response[0] == server_signature_);
+    if (response.size() >= 4 && response[1] == ServerMessage::Reverse) {
+        // Reverse request on the main connection, queued like the ones read in _process_rev
+        response.erase(response.begin() + 1);
+        std::lock_guard<std::mutex> lock(inbound_lock_);
+        inbound_rev_.push_back(std::move(response));
+        inbound_ready_.notify_one();
+        response.resize(0);
+        return false;
+    }
+    assert(response.size() == 3 || response.size() == 4);
     return true;
 }
 
-bool ClientSocket::_recv_rev_step(std::vector<std::vector<uint8_t>>& request) {
+bool ClientSocket::_recv_rev_step(std::vector<MessageFrame>& request) {
     auto ready = false;
-    auto ready_timeout = false;
     request.resize(0);
-    zmq_msg_t msg;
 
     while (is_alive_ && !is_lost_) {
-        auto timeout_ms = 100;
-        zmq_setsockopt(zmq_client_rev_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
-        auto rc = zmq_msg_init(&msg);
-        assert(rc == 0);
-        rc = zmq_msg_recv(&msg, zmq_client_rev_, 0);
-        if (rc == -1) {
-            ready_timeout = true;
+        rev_messages_.emplace_back();
+        if (!rev_messages_.back().recv(zmq_client_rev_, ZMQ_DONTWAIT)) {
             assert(zmq_errno() == EAGAIN);
-        }
-        if (!(is_alive_ && !is_lost_)) {
-            zmq_msg_close(&msg);
-            break;
-        }
-        timeout_ms = -1;
-        zmq_setsockopt(zmq_client_rev_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
-
-        if (!(is_alive_ && !is_lost_)) {
-            zmq_msg_close(&msg);
-            break;
-        }
-        if (ready_timeout) {
-            zmq_msg_close(&msg);
+            rev_messages_.pop_back();
             break;
         }
 
-        rev_messages_.resize(rev_messages_.size() + 1);
-        set_buffer(rev_messages_.back(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-        auto ready_last = !zmq_msg_more(&msg);
-        zmq_msg_close(&msg);
-        if (ready_last) {
+        if (!rev_messages_.back().more()) {
             ready = true;
             break;
         }
@@ -527,16 +645,22 @@ bool ClientSocket::_recv_rev_step(std::vector<std::vector<uint8_t>>& request) {
         return false;
     }
 
-    request = rev_messages_;
+    request.swap(rev_messages_);
     rev_messages_.clear();
-    assert(request.size() == 3);
+    assert(request.size() == 3 || request.size() == 4);
     assert(request[0] == server_signature_rev_);
     return true;
 }
 
-void ClientSocket::add_metadata(nlohmann::json data) { assert(false); }
+// Extra entries sent with AddClient, must be added before connect
+void ClientSocket::add_metadata(nlohmann::json data) {
+    assert(!is_connected_);
+    for (auto& item : data.items()) {
+        metadata_[item.key()] = item.value();
+    }
+}
 
-bool ClientSocket::is_validated() { return zmq_client_rev_ && is_validated_; }
+bool ClientSocket::is_validated() { return (zmq_client_rev_ || is_multiplexed_) && is_validated_; }
 
 std::recursive_mutex& ClientSocket::get_request_lock() { return request_lock_; }
 
@@ -547,63 +671,81 @@ nlohmann::json ClientSocket::get_metadata() { return metadata_; }
 nlohmann::json ClientSocket::get_server_metadata() { return server_metadata_; }
 
 void ClientSocket::set_closing() {
-    is_alive_ = false;
+    {
+        std::lock_guard<std::mutex> lock(connected_lock_);
+        is_alive_ = false;
+        connected_changed_.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        _wakeup();
+    }
+    {
+        std::lock_guard<std::mutex> lock(inbound_lock_);
+        inbound_ready_.notify_all();
+    }
+    std::lock_guard<std::mutex> lock(pending_lock_);
+    for (auto& item : pending_calls_) {
+        item.second->ready.notify_all();
+    }
+    pending_empty_.notify_all();
 }
 
 void ClientSocket::wait() {
-    zmq_pollitem_t pollitems[1] = {0};
-    pollitems[0].socket = zmq_client_;
-    pollitems[0].fd = 0;
-    pollitems[0].events = ZMQ_POLLIN;
-    pollitems[0].revents = 0;
-
-    while (is_alive_ && !is_lost_) {
-        auto rc = zmq_poll(pollitems, 1, 0);
-        if (pollitems[0].revents <= 0) {
-            // std::cerr << "Poll failed!" << std::endl;
-            break;
-        }
-        // rc = zmq_getsockopt(
-        //     s.handle, ZMQ_TYPE, cast(p_void, address(stype)), address(sz)
-        // )
-        // if rc < 0:
-        //     errno = zmq_errno()
-        //     if errno == ENOTSOCK:
-        //         s._closed = True
-        //         return True
-        //     elif errno == ZMQ_ETERM:
-        //         # don't raise ETERM when checking if we're closed
-        //         return False
-        // else:
-        //     _check_rc(rc)
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
+    // Responses are read by the I/O thread, wait until outstanding calls are answered
+    std::unique_lock<std::mutex> lock(pending_lock_);
+    pending_empty_.wait(lock, [this]() { return !is_alive_ || is_lost_ || pending_calls_.empty(); });
 }
 
 void ClientSocket::close() {
-    auto zmq_context = zmq_context_;
-    std::vector<void*> clients = {zmq_client_, zmq_client_rev_, zmq_monitor_};
-
-    is_alive_ = false;
+    std::vector<void*> clients = {zmq_client_, zmq_client_rev_, zmq_monitor_, zmq_wakeup_, zmq_wakeup_send_};
 
-    zmq_monitor_thread_->join();
+    set_closing();
 
+    if (zmq_io_thread_) {
+        zmq_io_thread_->join();
+    }
     auto rc = zmq_socket_monitor(zmq_client_, 0, 0);
     assert(rc == 0);
+    zmq_monitor_thread_->join();
+
+    // Outstanding callbacks complete with an empty response
+    std::vector<std::shared_ptr<PendingCallInfo>> failed;
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        for (auto& item : pending_calls_) {
+            if (item.second->callback) {
+                failed.push_back(item.second);
+            }
+        }
+    }
+    for (auto& call : failed) {
+        std::vector<uint8_t> empty;
+        _complete_call(call, empty);
+    }
 
     zmq_client_ = 0;
     zmq_client_rev_ = 0;
     zmq_monitor_ = 0;
+    zmq_wakeup_ = 0;
+    zmq_wakeup_send_ = 0;
     zmq_monitor_thread_.reset();
+    zmq_io_thread_.reset();
     zmq_context_ = 0;
 
-    for (int j = 0; j < 3; j++) {
+    // Replies queued just before close are still sent, the context may be shared with other sockets
+    int linger = CLOSE_LINGER_MS;
+    zmq_setsockopt(clients[0], ZMQ_LINGER, &linger, sizeof(linger));
+    if (clients[1]) {
+        zmq_setsockopt(clients[1], ZMQ_LINGER, &linger, sizeof(linger));
+    }
+
+    // The context is owned by RoutingSocket
+    for (int j = 0; j < clients.size(); j++) {
         if (clients[j]) {
             zmq_close(clients[j]);
         }
     }
-
-    zmq_close(zmq_context);
 }
 
 }  // namespace nrpc_cpp
\ No newline at end of file
@@ -10,6 +10,14 @@
  *          send_rev
  *          _validate_client
  *          _track_client
+ *          _process_norm
+ *          _process_rev
+ *          _complete_call
+ *          _fail_norm
+ *          _send_norm
+ *          _send_rev
+ *          _flush_outbound
+ *          _wakeup
  *          _recv_norm_step
  *          _recv_rev_step
  *          add_metadata
@@ -25,22 +33,33 @@
  */
 #pragma once
 #include "common_base.hpp"
+#include <deque>
 #include <mutex>
 
 namespace nrpc_cpp {
 
 class ClientSocket {
 public:
-    ClientSocket(std::string ip_address, int port, int port_rev, std::string socket_name);
+    ClientSocket(std::string ip_address, int port, int port_rev, std::string socket_name, void* zmq_context);
     void connect();
-    void send_norm(std::vector<std::vector<uint8_t>>& request);
-    bool recv_norm(std::vector<uint8_t>& response);
-    bool recv_rev(std::vector<std::vector<uint8_t>>& request, int timeout_ms = 0);
+    uint32_t send_norm(std::vector<std::vector<uint8_t>>& request,
+                       std::function<void(std::vector<uint8_t>&)> callback = nullptr);
+    bool recv_norm(uint32_t call_id, std::vector<uint8_t>& response);
+    bool recv_rev(std::vector<MessageFrame>& request, int timeout_ms = 0);
+    // Payload parts are handed to libzmq without a copy and left empty, see send_buffer
     void send_rev(std::vector<std::vector<uint8_t>>& response);
-    void _validate_client(std::vector<std::vector<uint8_t>>& req);
+    void _validate_client(std::vector<MessageFrame>& req);
     void _track_client();
-    bool _recv_norm_step(std::vector<std::vector<uint8_t>>& request);
-    bool _recv_rev_step(std::vector<std::vector<uint8_t>>& response);
+    void _process_norm();
+    void _process_rev();
+    void _complete_call(std::shared_ptr<PendingCallInfo> call, std::vector<uint8_t>& response);
+    void _fail_norm();
+    void _send_norm(std::vector<std::vector<uint8_t>>& request);
+    void _send_rev(std::vector<std::vector<uint8_t>>& response);
+    void _flush_outbound();
+    void _wakeup();
+    bool _recv_norm_step(std::vector<MessageFrame>& request);
+    bool _recv_rev_step(std::vector<MessageFrame>& response);
     void add_metadata(nlohmann::json data);
     bool is_validated();
     std::recursive_mutex& get_request_lock();
@@ -65,6 +84,7 @@ private:
     bool is_connected_{false};
     bool is_validated_{false};
     bool is_lost_{false};
+    bool is_multiplexed_{false};
     std::string client_errors_;
     nlohmann::json metadata_;
     nlohmann::json server_metadata_;
@@ -72,10 +92,26 @@ private:
     void* zmq_client_{0};
     void* zmq_client_rev_{0};
     void* zmq_monitor_{0};
+    void* zmq_wakeup_{0};
+    void* zmq_wakeup_send_{0};
     std::shared_ptr<std::thread> zmq_monitor_thread_;
+    std::shared_ptr<std::thread> zmq_io_thread_;
     std::recursive_mutex request_lock_;
-    std::vector<std::vector<uint8_t>> norm_messages_;
-    std::vector<std::vector<uint8_t>> rev_messages_;
+    std::mutex outbound_lock_;
+    std::deque<std::vector<std::vector<uint8_t>>> outbound_norm_;
+    std::deque<std::vector<std::vector<uint8_t>>> outbound_rev_;
+    std::mutex connected_lock_;
+    std::condition_variable connected_changed_;
+    std::mutex inbound_lock_;
+    std::condition_variable inbound_ready_;
+    std::deque<std::vector<MessageFrame>> inbound_rev_;
+    std::mutex pending_lock_;
+    std::map<uint32_t, std::shared_ptr<PendingCallInfo>> pending_calls_;
+    // Signalled when pending_calls_ becomes empty or the socket closes or is lost, see wait
+    std::condition_variable pending_empty_;
+    uint32_t next_call_id_{0};
+    std::vector<MessageFrame> norm_messages_;
+    std::vector<MessageFrame> rev_messages_;
 };
 
 }  // namespace nrpc_cpp
\ No newline at end of file
@@ -7,11 +7,20 @@
  *      g_all_types
  *      g_all_services
  *      g_all_servers
+ *      g_all_plans
  *      g_class_id
+ *      get_type_plan
+ *      find_type_plan
+ *      add_plan_field
  *      construct_item
  *      destroy_item
  *      construct_json
+ *      _assign_values
  *      assign_values
+ *      _write_binary
+ *      _read_binary
+ *      assign_binary
+ *      read_binary
  * 
  *      g_argv
  *      init
@@ -21,14 +30,33 @@
  *      g_base64_alphabet_rev
  *      base64_encode
  *      base64_decode
+ *      get_text_hash
+ *      MessageFrame
  *      get_string
  *      get_buffer
  *      get_buffer_json
+ *      get_buffer_binary
+ *      is_binary_buffer
+ *      get_buffer_call_id
+ *      get_call_id
+ *      get_buffer_route_id
+ *      get_route_id
+ *      get_buffer_response
+ *      get_method_label
  *      set_buffer
+ *      _free_buffer
+ *      send_buffer
+ *      send_buffer_copy
+ *      create_context
+ *      get_shared_context
+ *      get_inproc_address
  *      get_json
  */
 #include "common_base.hpp"
+#include <atomic>
+#include <cstring>
 #include <sstream>
+#include <zmq.h>
 // #include <boost/beast/core/detail/base64.hpp>
 
 namespace nrpc_cpp {
@@ -38,6 +66,8 @@ const std::vector<uint8_t> ServerMessage::ClientAdded = nrpc_cpp::get_buffer("Se
 const std::vector<uint8_t> ServerMessage::ValidateClient = nrpc_cpp::get_buffer("ServerMessage.ValidateClient");
 const std::vector<uint8_t> ServerMessage::ClientValidated = nrpc_cpp::get_buffer("ServerMessage.ClientValidated");
 const std::vector<uint8_t> ServerMessage::ForwardCall = nrpc_cpp::get_buffer("ServerMessage.ForwardCall");
+const std::vector<uint8_t> ServerMessage::ForwardTo = nrpc_cpp::get_buffer("ServerMessage.ForwardTo:");
+const std::vector<uint8_t> ServerMessage::Reverse = nrpc_cpp::get_buffer("rev");
 
 const std::vector<uint8_t> RoutingMessage::GetAppInfo = nrpc_cpp::get_buffer("RoutingMessage.GetAppInfo");
 const std::vector<uint8_t> RoutingMessage::GetSchema = nrpc_cpp::get_buffer("RoutingMessage.GetSchema");
@@ -46,8 +76,47 @@ const std::vector<uint8_t> RoutingMessage::SetSchema = nrpc_cpp::get_buffer("Rou
 std::map<std::string, ClassInfo> g_all_types;
 std::map<std::string, ServiceInfo> g_all_services;
 std::map<std::string, ServerInfo> g_all_servers;
+std::map<std::string, std::shared_ptr<TypePlan>> g_all_plans;
 int g_class_id = 1000;
 
+// Plans are created on first reference so that parents can point to children registered later
+std::shared_ptr<TypePlan> get_type_plan(std::string type_name) {
+    auto& plan = g_all_plans[type_name];
+    if (!plan) {
+        plan = std::make_shared<TypePlan>();
+        plan->type_name = type_name;
+        if (type_name == DYNAMIC_OBJECT) {
+            plan->size = sizeof(nlohmann::json);
+            plan->is_dynamic = true;
+        }
+    }
+    return plan;
+}
+
+const TypePlan* find_type_plan(const std::string& type_name) {
+    auto found = g_all_plans.find(type_name);
+    return found != g_all_plans.end() ? found->second.get() : nullptr;
+}
+
+void add_plan_field(TypePlan* plan, FieldPlan field) {
+    assert(field.id_value >= 0);
+    auto pos = std::find_if(plan->fields.begin(), plan->fields.end(),
+                            [&field](auto& x) { return x.field_name > field.field_name; });
+    auto index = (int)(pos - plan->fields.begin());
+    plan->fields.insert(pos, field);
+
+    // Fields behind the new one move up by one, only the new id gets a fresh slot
+    for (auto& item : plan->id_index) {
+        if (item >= index) {
+            item += 1;
+        }
+    }
+    if ((size_t)field.id_value >= plan->id_index.size()) {
+        plan->id_index.resize((size_t)field.id_value + 1, -1);
+    }
+    plan->id_index[field.id_value] = index;
+}
+
 void construct_item(std::string type_name, std::vector<uint8_t>& data) {
     g_all_types[type_name].instance_manager->_construct_item(data);
 }
@@ -56,61 +125,51 @@ void destroy_item(std::string type_name, std::vector<uint8_t>& data) {
     g_all_types[type_name].instance_manager->_destroy_item(data);
 }
 
-void assign_values(std::string type_name, uint8_t* res_data, int res_offset, int res_size, nlohmann::json& json_data, int target) {
-    if (type_name == DYNAMIC_OBJECT) {
-        auto obj_data = reinterpret_cast<nlohmann::json*>(res_data);
+static void _assign_values(const TypePlan& plan, uint8_t* obj_data, nlohmann::json& json_data, int target) {
+    if (plan.is_dynamic) {
+        auto item = reinterpret_cast<nlohmann::json*>(obj_data);
         if (target == 0) {
-            *obj_data = json_data;
+            *item = json_data;
         } else {
-            json_data = *obj_data;
+            json_data = *item;
         }
         return;
     }
-    
-    auto& type_info = g_all_types[type_name];
-    for (auto& kvp : type_info.fields) {
-        auto& item = kvp.second;
-        // std::cout << "ASSIGN " << item.name << std::endl;
+
+    for (auto& item : plan.fields) {
+        auto field_data = obj_data + item.offset;
         if (target == 0 && !json_data.contains(item.field_name)) {
             // keep default
-        } else if (!item.local) {
-            // skip
         } else if (item.field_type == FieldType::Complex) {
-            auto& child_type = g_all_types[item.field_type_str];
-            assert(child_type.type_name == item.field_type_str);
-            auto res_child_offset = res_offset + item.offset;
-            assert(res_child_offset + child_type.size <= res_size);
+            assert(item.child->size);
             if (target == 0) {
-                assign_values(item.field_type_str, res_data, res_child_offset, res_size, json_data.at(item.field_name), 0);
+                _assign_values(*item.child, field_data, json_data.at(item.field_name), 0);
             } else {
-                json_data[item.field_name] = nlohmann::json();
-                assign_values(item.field_type_str, res_data, res_child_offset, res_size, json_data.at(item.field_name), 1);
+                auto& child_json = json_data[item.field_name];
+                child_json = nlohmann::json();
+                _assign_values(*item.child, field_data, child_json, 1);
             }
         } else if (item.field_type == FieldType::Int) {
-            assert(res_offset + item.offset + 4 <= res_size);
             if (target == 0) {
-                json_data.at(item.field_name).get_to(*reinterpret_cast<int*>(&res_data[res_offset + item.offset]));
+                json_data.at(item.field_name).get_to(*reinterpret_cast<int*>(field_data));
             } else {
-                json_data[item.field_name] = *reinterpret_cast<int*>(&res_data[res_offset + item.offset]);
+                json_data[item.field_name] = *reinterpret_cast<int*>(field_data);
             }
         } else if (item.field_type == FieldType::Float) {
-            assert(res_offset + item.offset + 4 <= res_size);
             if (target == 0) {
-                json_data.at(item.field_name).get_to(*reinterpret_cast<float*>(&res_data[res_offset + item.offset]));
+                json_data.at(item.field_name).get_to(*reinterpret_cast<float*>(field_data));
             } else {
-                json_data[item.field_name] = *reinterpret_cast<float*>(&res_data[res_offset + item.offset]);
+                json_data[item.field_name] = *reinterpret_cast<float*>(field_data);
             }
         } else if (item.field_type == FieldType::String) {
-            assert(res_offset + item.offset + sizeof(std::string) <= res_size);
-            auto str = reinterpret_cast<std::string*>(&res_data[res_offset + item.offset]);
+            auto str = reinterpret_cast<std::string*>(field_data);
             if (target == 0) {
                 json_data.at(item.field_name).get_to(*str);
             } else {
                 json_data[item.field_name] = *str;
             }
         } else if (item.field_type == FieldType::Json) {
-            assert(res_offset + item.offset + sizeof(nlohmann::json) <= res_size);
-            auto item2 = reinterpret_cast<nlohmann::json*>(&res_data[res_offset + item.offset]);
+            auto item2 = reinterpret_cast<nlohmann::json*>(field_data);
             if (target == 0) {
                 json_data.at(item.field_name).get_to(*item2);
             } else {
@@ -122,6 +181,136 @@ void assign_values(std::string type_name, uint8_t* res_data, int res_offset, int
     }
 }
 
+void assign_values(std::string type_name, uint8_t* res_data, int res_offset, int res_size, nlohmann::json& json_data, int target) {
+    auto found = find_type_plan(type_name);
+    assert(found);
+    if (!found) {
+        return;
+    }
+    auto& plan = *found;
+    assert(plan.size && res_offset + plan.size <= res_size);
+    _assign_values(plan, &res_data[res_offset], json_data, target);
+}
+
+void assign_values(const TypePlan& plan, uint8_t* res_data, nlohmann::json& json_data, int target) {
+    _assign_values(plan, res_data, json_data, target);
+}
+
+static void _write_binary(const TypePlan& plan, uint8_t* obj_data, std::vector<uint8_t>& out) {
+    if (plan.is_dynamic) {
+        write_dynamic(out, *reinterpret_cast<nlohmann::json*>(obj_data));
+        return;
+    }
+
+    for (auto& item : plan.fields) {
+        auto field_data = obj_data + item.offset;
+        if (item.field_type == FieldType::Int) {
+            write_int_field(out, item.id_value, *reinterpret_cast<int*>(field_data));
+        } else if (item.field_type == FieldType::Float) {
+            write_float_field(out, item.id_value, *reinterpret_cast<float*>(field_data));
+        } else if (item.field_type == FieldType::String) {
+            write_string_field(out, item.id_value, *reinterpret_cast<std::string*>(field_data));
+        } else if (item.field_type == FieldType::Complex || item.field_type == FieldType::Json) {
+            assert(item.child->size);
+            auto start = begin_length_field(out, item.id_value);
+            _write_binary(*item.child, field_data, out);
+            write_length(out, start);
+        } else {
+            assert(false);
+        }
+    }
+}
+
+static bool _read_binary(const TypePlan& plan, uint8_t* obj_data, const uint8_t* pos, const uint8_t* end) {
+    if (plan.is_dynamic) {
+        return read_dynamic(pos, end, *reinterpret_cast<nlohmann::json*>(obj_data));
+    }
+
+    while (pos < end) {
+        WireField field;
+        if (!read_wire_field(pos, end, field)) {
+            return false;
+        }
+
+        // Remote only fields and unknown ids are not in the plan and are skipped
+        if (field.id_value >= plan.id_index.size() || plan.id_index[field.id_value] < 0) {
+            continue;
+        }
+
+        auto& item = plan.fields[plan.id_index[field.id_value]];
+        auto field_data = obj_data + item.offset;
+        if (item.field_type == FieldType::Int) {
+            read_int_field(field, *reinterpret_cast<int*>(field_data));
+        } else if (item.field_type == FieldType::Float) {
+            read_float_field(field, *reinterpret_cast<float*>(field_data));
+        } else if (item.field_type == FieldType::String) {
+            read_string_field(field, *reinterpret_cast<std::string*>(field_data));
+        } else if (item.field_type == FieldType::Complex || item.field_type == FieldType::Json) {
+            if (field.wire_type != WIRE_LENGTH) {
+                // Wire type mismatch, keep default
+                continue;
+            }
+            assert(item.child->size);
+            if (!_read_binary(*item.child, field_data, field.value_pos, field.value_pos + field.length)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool assign_binary(std::string type_name, uint8_t* res_data, int res_offset, int res_size, std::vector<uint8_t>& data,
+                   int target) {
+    auto found = find_type_plan(type_name);
+    assert(found);
+    if (!found) {
+        return false;
+    }
+    auto& plan = *found;
+    assert(plan.size && res_offset + plan.size <= res_size);
+    if (target == 0) {
+        return read_binary(type_name, res_data, res_offset, res_size, data);
+    } else {
+        data.resize(0);
+        data.push_back(BINARY_MARKER);
+        _write_binary(plan, &res_data[res_offset], data);
+        return true;
+    }
+}
+
+bool read_binary(std::string type_name, uint8_t* res_data, int res_offset, int res_size, std::span<const uint8_t> data) {
+    auto found = find_type_plan(type_name);
+    assert(found);
+    if (!found) {
+        return false;
+    }
+    auto& plan = *found;
+    assert(plan.size && res_offset + plan.size <= res_size);
+    if (!is_binary_buffer(data)) {
+        return false;
+    }
+    return _read_binary(plan, &res_data[res_offset], data.data() + 1, data.data() + data.size());
+}
+
+// Plan overloads skip the lookup by type name, used with plans resolved up front
+bool assign_binary(const TypePlan& plan, uint8_t* res_data, std::vector<uint8_t>& data, int target) {
+    if (target == 0) {
+        return read_binary(plan, res_data, data);
+    } else {
+        data.resize(0);
+        data.push_back(BINARY_MARKER);
+        _write_binary(plan, res_data, data);
+        return true;
+    }
+}
+
+bool read_binary(const TypePlan& plan, uint8_t* res_data, std::span<const uint8_t> data) {
+    if (!is_binary_buffer(data)) {
+        return false;
+    }
+    return _read_binary(plan, res_data, data.data() + 1, data.data() + data.size());
+}
+
 std::vector<std::string> g_argv;
 
 void init(int argc, char* argv[]) {
@@ -291,8 +480,56 @@ std::vector<uint8_t> base64_decode(std::string encoded) {
     return data;
 }
 
-std::string get_string(std::vector<uint8_t> data) { 
-    return std::string((const char *)&data[0], data.size()); 
+// FNV-1a, stable across processes and builds unlike std::hash
+std::string get_text_hash(std::string_view text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (auto c : text) {
+        hash ^= (uint8_t)c;
+        hash *= 1099511628211ull;
+    }
+    return boost::str(boost::format("%016x") % hash);
+}
+
+MessageFrame::MessageFrame() {
+    auto rc = zmq_msg_init(&msg_);
+    assert(rc == 0);
+}
+
+MessageFrame::MessageFrame(MessageFrame&& other) noexcept {
+    zmq_msg_init(&msg_);
+    zmq_msg_move(&msg_, &other.msg_);
+}
+
+MessageFrame& MessageFrame::operator=(MessageFrame&& other) noexcept {
+    if (this != &other) {
+        zmq_msg_move(&msg_, &other.msg_);
+    }
+    return *this;
+}
+
+MessageFrame::~MessageFrame() { zmq_msg_close(&msg_); }
+
+// Returns false when nothing was received, zmq_errno() tells why
+bool MessageFrame::recv(void* socket, int flags) { return zmq_msg_recv(&msg_, socket, flags) != -1; }
+
+bool MessageFrame::more() const { return zmq_msg_more(&msg_); }
+
+const uint8_t* MessageFrame::data() const {
+    return reinterpret_cast<const uint8_t*>(zmq_msg_data(const_cast<zmq_msg_t*>(&msg_)));
+}
+
+size_t MessageFrame::size() const { return zmq_msg_size(&msg_); }
+
+std::span<const uint8_t> MessageFrame::view() const { return std::span<const uint8_t>(data(), size()); }
+
+std::vector<uint8_t> MessageFrame::get_buffer() const { return std::vector<uint8_t>(data(), data() + size()); }
+
+bool MessageFrame::operator==(const std::vector<uint8_t>& other) const {
+    return size() == other.size() && (!size() || memcmp(data(), &other[0], size()) == 0);
+}
+
+std::string get_string(std::span<const uint8_t> data) { 
+    return std::string((const char *)data.data(), data.size()); 
 }
 
 std::vector<uint8_t> get_buffer(std::string str) {
@@ -330,13 +567,162 @@ std::vector<uint8_t> get_buffer(std::vector<uint8_t> a, std::vector<uint8_t> b)
     return res;
 }
 
+std::vector<uint8_t> get_buffer_binary() {
+    return std::vector<uint8_t>({BINARY_MARKER});
+}
+
+bool is_binary_buffer(std::span<const uint8_t> data) {
+    return data.size() && data[0] == BINARY_MARKER;
+}
+
+std::vector<uint8_t> get_buffer_call_id(uint32_t call_id) {
+    return std::vector<uint8_t>({
+        (uint8_t)call_id,
+        (uint8_t)(call_id >> 8),
+        (uint8_t)(call_id >> 16),
+        (uint8_t)(call_id >> 24),
+    });
+}
+
+uint32_t get_call_id(std::span<const uint8_t> data) {
+    if (data.size() != 4) {
+        return 0;
+    }
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+// Method frame with a route id agreed in the schema exchange, the leading zero byte
+// can't start a "Service.Method" name
+std::vector<uint8_t> get_buffer_route_id(uint32_t route_id) {
+    return std::vector<uint8_t>({
+        0,
+        (uint8_t)route_id,
+        (uint8_t)(route_id >> 8),
+        (uint8_t)(route_id >> 16),
+        (uint8_t)(route_id >> 24),
+    });
+}
+
+uint32_t get_route_id(std::span<const uint8_t> data) {
+    if (data.size() != 5 || data[0] != 0) {
+        return 0;
+    }
+    return get_call_id(data.subspan(1));
+}
+
+// Responses to routed calls echo the route frame, named calls get "response:<method_name>"
+std::vector<uint8_t> get_buffer_response(std::span<const uint8_t> method_frame) {
+    if (get_route_id(method_frame)) {
+        return std::vector<uint8_t>(method_frame.begin(), method_frame.end());
+    }
+    auto prefix = std::string_view("response:");
+    std::vector<uint8_t> result;
+    result.reserve(prefix.size() + method_frame.size());
+    result.insert(result.end(), prefix.begin(), prefix.end());
+    result.insert(result.end(), method_frame.begin(), method_frame.end());
+    return result;
+}
+
+// Printable name of a method or response frame for log messages
+std::string get_method_label(std::span<const uint8_t> method_frame) {
+    auto route_id = get_route_id(method_frame);
+    if (route_id) {
+        return boost::str(boost::format("route:%1%") % route_id);
+    }
+    return get_string(method_frame);
+}
+
 void set_buffer(std::vector<uint8_t> &dest, void *data, size_t size) {
     auto buf = reinterpret_cast<uint8_t *>(data);
     dest.assign(buf, buf + size);
 }
 
-nlohmann::json get_json(std::vector<uint8_t> data) { 
-    return nlohmann::json::parse(get_string(data)); 
+static void _free_buffer(void* data, void* hint) {
+    delete reinterpret_cast<std::vector<uint8_t>*>(hint);
+}
+
+// Moves data into a heap buffer owned by libzmq and released from its I/O thread once sent,
+// data is left empty. Small frames are cheaper to copy than to allocate a separate owner for.
+int send_buffer(void* socket, std::vector<uint8_t>& data, int flags) {
+    if (data.size() < ZERO_COPY_MIN) {
+        auto rc = send_buffer_copy(socket, data, flags);
+        data.resize(0);
+        return rc;
+    }
+
+    auto size = data.size();
+    auto owner = new std::vector<uint8_t>();
+    owner->swap(data);
+    zmq_msg_t msg;
+    auto rc = zmq_msg_init_data(&msg, &(*owner)[0], size, _free_buffer, owner);
+    assert(rc == 0);
+    rc = zmq_msg_send(&msg, socket, flags);
+    if (rc == -1) {
+        // Not sent, closing the message frees the buffer through _free_buffer
+        zmq_msg_close(&msg);
+        return rc;
+    }
+    assert(rc == (int)size);
+    return rc;
+}
+
+int send_buffer_copy(void* socket, const std::vector<uint8_t>& data, int flags) {
+    zmq_msg_t msg;
+    auto rc = zmq_msg_init_size(&msg, data.size());
+    assert(rc == 0);
+    if (data.size()) {
+        memcpy(zmq_msg_data(&msg), &data[0], data.size());
+    }
+    rc = zmq_msg_send(&msg, socket, flags);
+    if (rc == -1) {
+        zmq_msg_close(&msg);
+        return rc;
+    }
+    assert(rc == (int)data.size());
+    zmq_msg_close(&msg);
+    return rc;
+}
+
+// I/O thread options only take effect before the first socket is created
+void* create_context(int io_threads, const std::vector<int>& affinity) {
+    auto context = zmq_ctx_new();
+    assert(context);
+    auto rc = zmq_ctx_set(context, ZMQ_IO_THREADS, io_threads);
+    assert(rc == 0);
+    for (auto cpu : affinity) {
+        rc = zmq_ctx_set(context, ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+        assert(rc == 0);
+    }
+    return context;
+}
+
+// Created by the first socket that asks for it and never terminated, later options can't change it
+void* get_shared_context(int io_threads, const std::vector<int>& affinity) {
+    static std::mutex context_lock;
+    static void* context = 0;
+    static int context_io_threads = 0;
+    static std::vector<int> context_affinity;
+    std::lock_guard<std::mutex> lock(context_lock);
+    if (!context) {
+        context = create_context(io_threads, affinity);
+        context_io_threads = io_threads;
+        context_affinity = affinity;
+    } else if (io_threads != context_io_threads || affinity != context_affinity) {
+        std::cerr << boost::str(boost::format("Shared context options ignored! Created with io_threads=%1%, affinity=%2%") %
+                                context_io_threads % nlohmann::json(context_affinity).dump())
+                  << std::endl;
+    }
+    return context;
+}
+
+std::string get_inproc_address(std::string prefix) {
+    // Object addresses get reused while a closed socket's endpoint is still registered in the shared context
+    static std::atomic<uint64_t> next_id{0};
+    return boost::str(boost::format("inproc://%1%-%2%") % prefix % next_id++);
+}
+
+nlohmann::json get_json(std::span<const uint8_t> data) { 
+    return nlohmann::json::parse(data.begin(), data.end()); 
 }
 
 bool same_sets(std::vector<int>& a, std::vector<int>& b) {
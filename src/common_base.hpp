@@ -1,4 +1,3 @@
-
 /**
  * Contents:
  *
@@ -11,21 +10,55 @@
  *      WebSocketInfo
  *      SocketMetadataInfo
  *      ClientInfo
+ *      IdentityHash
+ *      get_identity
+ *      MessageFrame
+ *      MessageInfo
+ *      PendingCallInfo
  *      ApplicationInfo
  *      SchemaInfo
  *      FieldType
  *      TypeNames
+ *      WireType
+ *      BINARY_MARKER
+ *      ZERO_COPY_MIN
+ *      ADMISSION_TIMEOUT_MS
+ *      ADMISSION_RETRY_MS
+ *      BROADCAST_TIMEOUT_MS
+ *      CANCELLED_CALL_TTL_MS
+ *      CLOSE_LINGER_MS
+ *      WireField
+ *      write_varint
+ *      read_varint
+ *      write_length
+ *      read_wire_field
+ *      write_int_field
+ *      write_float_field
+ *      write_string_field
+ *      begin_length_field
+ *      write_dynamic
+ *      read_int_field
+ *      read_float_field
+ *      read_string_field
+ *      read_dynamic
  *      DYNAMIC_OBJECT
  *      FieldInfo
+ *      FieldPlan
+ *      TypePlan
  *      MethodInfo
  *      ClassInfo
  *      ServiceInfo
  *      ServerInfo
+ *      RouteInfo
  *
  *      g_all_types
  *      g_all_services
  *      g_all_servers
+ *      g_all_plans
  *      g_class_id
+ *      get_type_plan
+ *      find_type_plan
+ *      add_plan_field
  *      TypedClassManager
  *          register_members()
  *      get_class_name
@@ -33,11 +66,20 @@
  *      ServerBase
  *      CommonInstanceManager
  *      TypedInstanceManager
+ *      PooledItem
+ *      Task
+ *      TaskResult
+ *      CallError
+ *      CallAwaiter
  *      CommonFunctionManager
  *      TypedFunctionManager
+ *      TypedFunctionManager<REQ, RES&>
+ *      TypedFunctionManager<REQ, Task<RES>>
+ *      MethodTraits
  *      $rpcclass
  *          struct TypedClassManager<TP>
 *               register_members()
+*               visit_fields()
  *      $field
  *      $method
  *      register_member_field
@@ -50,6 +92,17 @@
  *      destroy_item
  *      construct_json
  *      assign_values
+ *      assign_binary
+ *      read_binary
+ *      assign_static_value
+ *      write_static_value
+ *      read_static_value
+ *      StaticFieldReader
+ *      get_static_readers
+ *      assign_static
+ *      write_static
+ *      read_static
+ *      assign_static_binary
  *      get_class_string
  *      get_simple_type
  *
@@ -61,10 +114,24 @@
  *      g_base64_alphabet_rev
  *      base64_encode
  *      base64_decode
+ *      get_text_hash
  *      get_string
  *      get_buffer
  *      get_buffer_json
+ *      get_buffer_binary
+ *      is_binary_buffer
+ *      get_buffer_call_id
+ *      get_call_id
+ *      get_buffer_route_id
+ *      get_route_id
+ *      get_buffer_response
+ *      get_method_label
  *      set_buffer
+ *      send_buffer
+ *      send_buffer_copy
+ *      create_context
+ *      get_shared_context
+ *      get_inproc_address
  *      get_json
  *      find
  *      find_contains
@@ -75,11 +142,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <coroutine>
 #include <cstdio>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <mutex>
+#include <new>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include <nlohmann/json.hpp>
@@ -88,12 +167,14 @@
 
 #undef ZMQ_BUILD_DRAFT_API
 #define ZMQ_BUILD_DRAFT_API
+#include <zmq.h>
 
 // clang-format off
 namespace nrpc_cpp {
     class ServerBase;
     class CommonInstanceManager;
     class CommonFunctionManager;
+    struct TypePlan;
 }  // namespace nrpc_cpp
 // clang-format on
 
@@ -125,6 +206,15 @@ public:
     std::string name;
     nlohmann::json types;
     int port{0};
+    // Handler threads, for server calls on BIND sockets and reverse calls on CONNECT sockets
+    int workers{0};
+    // Sockets use the process-wide context unless one is passed to RoutingSocket or shared_context is
+    // false, io_threads and affinity (CPU ids for libzmq I/O threads) apply when the context is created
+    bool shared_context{true};
+    int io_threads{1};
+    std::vector<int> affinity;
+    // Both directions share one connection on port, no reverse socket on port + 10000
+    bool multiplex{false};
 };
 
 class ServerMessage {
@@ -134,6 +224,10 @@ public:
     const static std::vector<uint8_t> ClientAdded;
     const static std::vector<uint8_t> ClientValidated;
     const static std::vector<uint8_t> ForwardCall;
+    // Method frame prefix of "ServerMessage.ForwardTo:<client_id>:<method_name>", the payload is relayed as is
+    const static std::vector<uint8_t> ForwardTo;
+    // Marks reverse direction messages when both directions share the main connection
+    const static std::vector<uint8_t> Reverse;
 };
 
 class RoutingMessage {
@@ -172,6 +266,70 @@ struct ClientInfo {
     std::chrono::time_point<std::chrono::steady_clock> connect_time;
     bool is_validated{false};
     bool is_lost{false};
+    // Admission state, ValidateClient is resent until the reverse connection answers
+    std::vector<uint8_t> validate_request;
+    std::chrono::time_point<std::chrono::steady_clock> validate_time;
+    bool is_validating{false};
+    bool is_connected_rev{false};
+    // Reverse direction runs over the main connection, client_signature_rev equals client_signature
+    bool is_multiplexed{false};
+    // Route ids published by the client in SetSchema, guarded by RoutingSocket's schema lock
+    std::unordered_map<std::string, uint32_t> routes;
+};
+
+// Routing identities are keyed as strings, lookups take a view of the received frame without a copy
+struct IdentityHash {
+    using is_transparent = void;
+    size_t operator()(std::string_view value) const { return std::hash<std::string_view>()(value); }
+};
+
+inline std::string_view get_identity(std::span<const uint8_t> data) {
+    return std::string_view(reinterpret_cast<const char*>(data.data()), data.size());
+}
+
+// Received frame, the payload stays in libzmq's buffer and is read through a span view.
+// Converts to std::span<const uint8_t> so get_json/get_string/is_binary_buffer parse in place.
+class MessageFrame {
+public:
+    MessageFrame();
+    MessageFrame(MessageFrame &&other) noexcept;
+    MessageFrame &operator=(MessageFrame &&other) noexcept;
+    MessageFrame(const MessageFrame &) = delete;
+    MessageFrame &operator=(const MessageFrame &) = delete;
+    ~MessageFrame();
+
+    bool recv(void *socket, int flags);
+    bool more() const;
+    const uint8_t *data() const;
+    size_t size() const;
+    std::span<const uint8_t> view() const;
+    std::vector<uint8_t> get_buffer() const;
+    operator std::span<const uint8_t>() const { return view(); }
+    bool operator==(const std::vector<uint8_t> &other) const;
+
+private:
+    zmq_msg_t msg_;
+};
+
+struct MessageInfo {
+    int client_id{0};
+    std::vector<std::vector<uint8_t>> parts;
+    std::vector<MessageFrame> frames;
+};
+
+// Request frames may carry a 4th call id frame which is echoed in the response,
+// see get_buffer_call_id. Calls with a callback are completed on the I/O thread,
+// an empty response means the call failed. Calls that timed out stay cancelled
+// until their late response arrives or the client is lost.
+struct PendingCallInfo {
+    uint32_t call_id{0};
+    int client_id{0};
+    bool is_done{false};
+    bool is_cancelled{false};
+    std::chrono::steady_clock::time_point expire_time;
+    std::vector<uint8_t> response;
+    std::condition_variable ready;
+    std::function<void(std::vector<uint8_t>&)> callback;
 };
 
 class ApplicationInfo {
@@ -244,6 +402,7 @@ public:
         std::string request_type;
         std::string response_type;
         int id_value{0};
+        int route_id{0};
         bool local{false};
         std::string method_errors;
     };
@@ -303,6 +462,174 @@ const std::string TypeNames[] = {
 const std::string DYNAMIC_OBJECT = "dict";
 // clang-format on
 
+// FormatType::BINARY field encoding, each field is written as:
+//      varint(id_value << 3 | WireType), value
+//
+// FieldType::Int      -> VARINT (zigzag)
+// FieldType::Float    -> FIXED32 (little endian)
+// FieldType::String   -> LENGTH, raw bytes
+// FieldType::Complex  -> LENGTH, nested fields
+// FieldType::Json     -> LENGTH, msgpack
+//
+// Fields with unknown id_value (or local == false) are skipped using the wire type.
+enum WireType {
+    WIRE_VARINT = 0,
+    WIRE_LENGTH = 2,
+    WIRE_FIXED32 = 5,
+};
+
+// First byte of FormatType::BINARY payloads, never valid as JSON text
+const uint8_t BINARY_MARKER = 0;
+
+// Frames from this size up are handed to libzmq without a copy, see send_buffer
+const size_t ZERO_COPY_MIN = 1024;
+
+// Clients that don't complete the reverse channel handshake in time are dropped, see ServerSocket::_admit_clients
+const int ADMISSION_TIMEOUT_MS = 10000;
+const int ADMISSION_RETRY_MS = 10;
+
+// Default gather time of RoutingSocket::broadcast_call, clients that answer later are left out
+const int BROADCAST_TIMEOUT_MS = 5000;
+
+// Timed-out calls wait this long for a late response before they are dropped, see ServerSocket::_expire_calls
+const int CANCELLED_CALL_TTL_MS = 30000;
+
+// Messages still queued when a socket closes get this long to be sent, a lost peer can't hold up zmq_ctx_term
+const int CLOSE_LINGER_MS = 1000;
+
+// One decoded tag/value pair, value_pos and length are set for WIRE_LENGTH and WIRE_FIXED32
+struct WireField {
+    uint64_t id_value{0};
+    int wire_type{0};
+    uint64_t value{0};
+    const uint8_t *value_pos{nullptr};
+    uint64_t length{0};
+};
+
+inline void write_varint(std::vector<uint8_t> &out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((uint8_t)value);
+}
+
+inline bool read_varint(const uint8_t *&pos, const uint8_t *end, uint64_t &value) {
+    value = 0;
+    for (int shift = 0; pos < end && shift < 64; shift += 7) {
+        auto byte = *pos++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Length prefix is unknown up front, one byte is reserved at start and shifted if needed
+inline void write_length(std::vector<uint8_t> &out, size_t start) {
+    auto length = out.size() - start - 1;
+    if (length < 0x80) {
+        out[start] = (uint8_t)length;
+    } else {
+        std::vector<uint8_t> prefix;
+        write_varint(prefix, length);
+        out[start] = prefix[0];
+        out.insert(out.begin() + start + 1, prefix.begin() + 1, prefix.end());
+    }
+}
+
+inline bool read_wire_field(const uint8_t *&pos, const uint8_t *end, WireField &field) {
+    uint64_t tag = 0;
+    if (!read_varint(pos, end, tag)) {
+        return false;
+    }
+    field.wire_type = (int)(tag & 7);
+    field.id_value = tag >> 3;
+    field.value_pos = pos;
+    field.length = 0;
+    if (field.wire_type == WIRE_VARINT) {
+        return read_varint(pos, end, field.value);
+    } else if (field.wire_type == WIRE_FIXED32) {
+        if (end - pos < 4) {
+            return false;
+        }
+        field.length = 4;
+        pos += 4;
+        return true;
+    } else if (field.wire_type == WIRE_LENGTH) {
+        if (!read_varint(pos, end, field.length) || field.length > (uint64_t)(end - pos)) {
+            return false;
+        }
+        field.value_pos = pos;
+        pos += field.length;
+        return true;
+    }
+    return false;
+}
+
+// Field encoders shared by the TypePlan path (_write_binary) and the static path (write_static_value)
+inline void write_int_field(std::vector<uint8_t> &out, int id, int value) {
+    write_varint(out, ((uint64_t)id << 3) | WIRE_VARINT);
+    write_varint(out, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+inline void write_float_field(std::vector<uint8_t> &out, int id, float value) {
+    uint32_t bits = 0;
+    memcpy(&bits, &value, 4);
+    write_varint(out, ((uint64_t)id << 3) | WIRE_FIXED32);
+    for (int j = 0; j < 4; j++) {
+        out.push_back((uint8_t)(bits >> (j * 8)));
+    }
+}
+
+inline void write_string_field(std::vector<uint8_t> &out, int id, const std::string &value) {
+    write_varint(out, ((uint64_t)id << 3) | WIRE_LENGTH);
+    write_varint(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// Returns the reserved length byte, the nested value is written next and closed with write_length
+inline size_t begin_length_field(std::vector<uint8_t> &out, int id) {
+    write_varint(out, ((uint64_t)id << 3) | WIRE_LENGTH);
+    auto start = out.size();
+    out.push_back(0);
+    return start;
+}
+
+inline void write_dynamic(std::vector<uint8_t> &out, const nlohmann::json &value) {
+    nlohmann::json::to_msgpack(value, out);
+}
+
+// Field decoders, a wire type mismatch keeps the default
+inline void read_int_field(const WireField &field, int &value) {
+    if (field.wire_type == WIRE_VARINT) {
+        auto zigzag = (uint32_t)field.value;
+        value = (int)((zigzag >> 1) ^ (~(zigzag & 1) + 1));
+    }
+}
+
+inline void read_float_field(const WireField &field, float &value) {
+    if (field.wire_type == WIRE_FIXED32) {
+        uint32_t bits = 0;
+        for (int j = 0; j < 4; j++) {
+            bits |= (uint32_t)field.value_pos[j] << (j * 8);
+        }
+        memcpy(&value, &bits, 4);
+    }
+}
+
+inline void read_string_field(const WireField &field, std::string &value) {
+    if (field.wire_type == WIRE_LENGTH) {
+        value.assign((const char *)field.value_pos, field.length);
+    }
+}
+
+inline bool read_dynamic(const uint8_t *pos, const uint8_t *end, nlohmann::json &value) {
+    value = nlohmann::json::from_msgpack(pos, end, true, false);
+    return !value.is_discarded();
+}
+
 struct FieldInfo {
     std::string field_name;
     FieldType field_type{FieldType::Unknown};
@@ -314,6 +641,24 @@ struct FieldInfo {
     std::string field_errors;
 };
 
+// Flat field list of one type used by assign_values and assign_binary, built once by
+// register_member_field. Only local fields are listed, sorted by field_name.
+struct FieldPlan {
+    std::string field_name;
+    FieldType field_type{FieldType::Unknown};
+    int id_value{0};
+    int offset{0};
+    const TypePlan *child{nullptr};
+};
+
+struct TypePlan {
+    std::string type_name;
+    int size{0};
+    bool is_dynamic{false};
+    std::vector<FieldPlan> fields;
+    std::vector<int> id_index;
+};
+
 struct MethodInfo {
     std::string method_name;
     std::string request_type;
@@ -333,6 +678,7 @@ struct ClassInfo {
     bool local{false};
     std::string type_errors;
     std::shared_ptr<CommonInstanceManager> instance_manager;
+    std::shared_ptr<TypePlan> plan;
 };
 
 struct ServiceInfo {
@@ -350,11 +696,33 @@ struct ServerInfo {
     std::string server_errors;
 };
 
+// Dispatch table entry of a locally served method, the route id on the wire is the index + 1,
+// see get_buffer_route_id. Points into RoutingSocket's known_services_/known_servers_.
+struct RouteInfo {
+    uint32_t route_id{0};
+    std::string method_name;
+    ServiceInfo *service{0};
+    ServerInfo *server{0};
+    MethodInfo *method{0};
+    // Resolved once by _add_routes, a missing type leaves these empty and fills method_errors
+    ClassInfo *request_type{0};
+    ClassInfo *response_type{0};
+    const TypePlan *request_plan{0};
+    const TypePlan *response_plan{0};
+};
+
 extern std::map<std::string, ClassInfo> g_all_types;
 extern std::map<std::string, ServiceInfo> g_all_services;
 extern std::map<std::string, ServerInfo> g_all_servers;
+extern std::map<std::string, std::shared_ptr<TypePlan>> g_all_plans;
 extern int g_class_id;
 
+// Creates missing plans, only used while types are registered
+std::shared_ptr<TypePlan> get_type_plan(std::string type_name);
+// Runtime lookup, returns nullptr for unknown types and never changes g_all_plans
+const TypePlan *find_type_plan(const std::string &type_name);
+void add_plan_field(TypePlan *plan, FieldPlan field);
+
 template <class TP>
 struct TypedClassManager {
     void register_members(int type, ServerBase* server_instance, std::string server_name) {
@@ -400,6 +768,9 @@ class CommonInstanceManager {
 public:
     virtual void _construct_item(std::vector<uint8_t> &obj) = 0;
     virtual void _destroy_item(std::vector<uint8_t> &obj) = 0;
+    // Constructs an item in pooled storage aligned for its type, release may run on another thread
+    virtual uint8_t *_acquire_item() = 0;
+    virtual void _release_item(uint8_t *obj) = 0;
     virtual int _get_class_id() = 0;
 };
 
@@ -419,30 +790,307 @@ public:
         obj.resize(0);
     }
 
+    uint8_t *_acquire_item() {
+        auto &pool = _get_pool();
+        void *storage = nullptr;
+        if (pool.items.empty()) {
+            storage = ::operator new(sizeof(TP), std::align_val_t(alignof(TP)));
+        } else {
+            storage = pool.items.back();
+            pool.items.pop_back();
+        }
+        return reinterpret_cast<uint8_t *>(new (storage) TP());
+    }
+
+    void _release_item(uint8_t *obj) {
+        auto &pool = _get_pool();
+        reinterpret_cast<TP *>(obj)->~TP();
+        if (pool.items.size() < POOL_SIZE) {
+            pool.items.push_back(obj);
+        } else {
+            ::operator delete(obj, std::align_val_t(alignof(TP)));
+        }
+    }
+
     int _get_class_id() { return class_id_; }
 
 private:
+    // Free storage kept per thread, enough for the calls a worker has in flight
+    const static size_t POOL_SIZE = 32;
+
+    struct ItemPool {
+        std::vector<void *> items;
+        ~ItemPool() {
+            for (auto item : items) {
+                ::operator delete(item, std::align_val_t(alignof(TP)));
+            }
+        }
+    };
+
+    static ItemPool &_get_pool() {
+        static thread_local ItemPool pool;
+        return pool;
+    }
+
     int class_id_{0};
 };
 
+// Pooled item that goes back to its manager when the owner leaves scope, e.g. when a
+// handler throws. release() hands the item over to code that returns it itself.
+class PooledItem {
+public:
+    PooledItem(CommonInstanceManager *manager) : manager_(manager), item_(manager->_acquire_item()) {}
+    PooledItem(const PooledItem &) = delete;
+    PooledItem &operator=(const PooledItem &) = delete;
+    ~PooledItem() {
+        if (item_) {
+            manager_->_release_item(item_);
+        }
+    }
+
+    uint8_t *get() { return item_; }
+    uint8_t *release() {
+        auto item = item_;
+        item_ = nullptr;
+        return item;
+    }
+
+private:
+    CommonInstanceManager *manager_;
+    uint8_t *item_;
+};
+
+// Return type of awaitable $method handlers, e.g.
+//
+//      nrpc_cpp::Task<HelloResponse> Hello(HelloRequest req) {
+//          auto res = co_await sock->co_server_call("OtherService.Other", ...);
+//          co_return ...;
+//      }
+//
+// Tasks are lazy, they run when awaited or when start() is called.
+template <class T>
+class Task {
+public:
+    struct FinalAwaiter;
+
+    struct promise_type {
+        T value;
+        std::coroutine_handle<> continuation;
+        std::function<void(T &, std::exception_ptr)> done;
+        std::exception_ptr error;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+            auto &promise = handle.promise();
+            if (promise.continuation) {
+                return promise.continuation;
+            }
+            // Started with start(), nobody owns the frame anymore, done gets the error if the task failed
+            auto done = std::move(promise.done);
+            done(promise.value, promise.error);
+            handle.destroy();
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    Task(Task &&other) noexcept : handle_(other.handle_) { other.handle_ = nullptr; }
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+        handle_.promise().continuation = caller;
+        return handle_;
+    }
+    T await_resume() {
+        if (handle_.promise().error) {
+            std::rethrow_exception(handle_.promise().error);
+        }
+        return std::move(handle_.promise().value);
+    }
+
+    // done runs when the task returns, with the exception it ended with or nullptr
+    void start(std::function<void(T &, std::exception_ptr)> done) {
+        assert(handle_);
+        assert(done);
+        auto handle = handle_;
+        handle_ = nullptr;
+        handle.promise().done = done;
+        handle.resume();
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// Handler result type as seen by the schema, Task<RES> is registered as RES
+template <class T>
+struct TaskResult {
+    typedef T type;
+};
+template <class T>
+struct TaskResult<Task<T>> {
+    typedef T type;
+};
+
+// Reported by the async call variants when a call ends without a response, e.g. the
+// peer was lost or the socket closed. Futures and co_await throw it, callbacks receive it.
+class CallError : public std::runtime_error {
+public:
+    CallError(const std::string &method_name) : std::runtime_error("Call failed! " + method_name) {}
+};
+
+// Returned by RoutingSocket::co_server_call and co_client_call. The awaiting
+// coroutine resumes on the thread that completes the call, see server_call_async.
+template <class T>
+class CallAwaiter {
+public:
+    CallAwaiter(std::function<void(std::function<void(T, std::exception_ptr)>)> start) : start_(start) {}
+
+    bool await_ready() { return false; }
+    // Whichever of the callback and await_suspend finishes second continues the coroutine,
+    // so a callback running inline or on another thread never resumes it before it suspends
+    bool await_suspend(std::coroutine_handle<> handle) {
+        start_([this, handle](T result, std::exception_ptr error) {
+            result_ = std::move(result);
+            error_ = error;
+            if (is_finished_.exchange(true)) {
+                handle.resume();
+            }
+        });
+        return !is_finished_.exchange(true);
+    }
+    T await_resume() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return std::move(result_);
+    }
+
+private:
+    std::function<void(std::function<void(T, std::exception_ptr)>)> start_;
+    T result_;
+    std::exception_ptr error_;
+    std::atomic<bool> is_finished_{false};
+};
+
 class CommonFunctionManager {
 public:
-    virtual void invoke_function(ServerBase *obj, std::vector<uint8_t> &req, std::vector<uint8_t> &res) = 0;
+    // req and res point to constructed items, see CommonInstanceManager::_acquire_item
+    virtual void invoke_function(ServerBase *obj, uint8_t *req, uint8_t *res) = 0;
+    // Awaitable handlers assign res later and then call done, with the exception if the handler failed
+    virtual bool is_async() { return false; }
+    virtual void invoke_async(ServerBase *obj, uint8_t *req, uint8_t *res, std::function<void(std::exception_ptr)> done) {
+        invoke_function(obj, req, res);
+        done(nullptr);
+    }
 };
 
+// REQ is the handler's parameter type, i.e. REQ, const REQ& or REQ&&. The pooled request
+// is released after the call, so it is always passed as an rvalue and moved, never copied.
 template <class REQ, class RES>
 class TypedFunctionManager : public CommonFunctionManager {
 public:
-    TypedFunctionManager(RES (ServerBase::*method_pointer)(REQ)) {
+    typedef RES (ServerBase::*FN)(REQ);
+
+    TypedFunctionManager(FN method_pointer) {
+        _ptr = method_pointer;
+    }
+
+    void invoke_function(ServerBase *obj, uint8_t *req, uint8_t *res) override {
+        auto &request = *reinterpret_cast<std::decay_t<REQ> *>(req);
+        *reinterpret_cast<RES *>(res) = (obj->*_ptr)(std::move(request));
+    }
+
+private:
+    FN _ptr;
+};
+
+// Handlers writing into the pooled response, e.g. void Hello(const HelloRequest& req, HelloResponse& res)
+template <class REQ, class RES>
+class TypedFunctionManager<REQ, RES &> : public CommonFunctionManager {
+public:
+    typedef void (ServerBase::*FN)(REQ, RES &);
+
+    TypedFunctionManager(FN method_pointer) {
+        _ptr = method_pointer;
+    }
+
+    void invoke_function(ServerBase *obj, uint8_t *req, uint8_t *res) override {
+        auto &request = *reinterpret_cast<std::decay_t<REQ> *>(req);
+        (obj->*_ptr)(std::move(request), *reinterpret_cast<RES *>(res));
+    }
+
+private:
+    FN _ptr;
+};
+
+template <class REQ, class RES>
+class TypedFunctionManager<REQ, Task<RES>> : public CommonFunctionManager {
+public:
+    typedef Task<RES> (ServerBase::*FN)(REQ);
+
+    // The request is released once the task suspends, a reference would dangle
+    static_assert(!std::is_reference_v<REQ>, "Awaitable handlers take the request by value");
+
+    TypedFunctionManager(FN method_pointer) {
         _ptr = method_pointer;
     }
 
-    void invoke_function(ServerBase *obj, std::vector<uint8_t> &req, std::vector<uint8_t> &res) override {
-        *reinterpret_cast<RES *>(&res.at(0)) = (obj->*_ptr)(*reinterpret_cast<REQ *>(&req.at(0)));
+    // Waiting here for the task would deadlock when it awaits a call completed on this thread,
+    // awaitable handlers only run through invoke_async
+    void invoke_function(ServerBase *obj, uint8_t *req, uint8_t *res) override {
+        throw CallError("Awaitable handlers need invoke_async");
+    }
+
+    bool is_async() override { return true; }
+
+    void invoke_async(ServerBase *obj, uint8_t *req, uint8_t *res, std::function<void(std::exception_ptr)> done) override {
+        auto res_ptr = reinterpret_cast<RES *>(res);
+        (obj->*_ptr)(std::move(*reinterpret_cast<REQ *>(req))).start([res_ptr, done](RES &value, std::exception_ptr error) {
+            if (!error) {
+                *res_ptr = std::move(value);
+            }
+            done(error);
+        });
     }
 
 private:
-    RES (ServerBase::*_ptr)(REQ);
+    FN _ptr;
+};
+
+// Handler shapes accepted by $method:
+//
+//      RES Hello(REQ req)                  also const REQ& and REQ&&
+//      Task<RES> Hello(REQ req)
+//      void Hello(const REQ& req, RES& res)
+//
+template <class FN>
+struct MethodTraits;
+template <class SR, class RES, class REQ>
+struct MethodTraits<RES (SR::*)(REQ)> {
+    typedef std::decay_t<REQ> request_type;
+    typedef typename TaskResult<RES>::type response_type;
+    typedef TypedFunctionManager<REQ, RES> function_manager;
+};
+template <class SR, class RES, class REQ>
+struct MethodTraits<void (SR::*)(REQ, RES &)> {
+    typedef std::decay_t<REQ> request_type;
+    typedef RES response_type;
+    typedef TypedFunctionManager<REQ, RES &> function_manager;
 };
 
 // nrpc::type<TP>() invokes "TypedClassManager::register_members" once.
@@ -475,6 +1123,24 @@ private:
                 TP *field_ref = nullptr;                                                                    \
                 __VA_ARGS__;                                                                                \
             }                                                                                               \
+            /* Same field list expanded against local lambdas, visitor(field_name, id, member) */           \
+            template <class SR, class V>                                                                    \
+            static void visit_fields(SR *field_ref, V &&visitor) {                                          \
+                int m_type = 0;                                                                             \
+                const char *m_class_name = #TP;                                                             \
+                const char *m_server_name = "";                                                             \
+                SR *m_server_instance = nullptr;                                                            \
+                auto register_member_field = [&visitor](int, const char *, const char *field_name, SR *,    \
+                                                        auto *member, int id) {                             \
+                    visitor(field_name, id, *member);                                                       \
+                    return 0;                                                                               \
+                };                                                                                          \
+                auto register_member_service_method = [](auto &&...) { return 0; };                        \
+                auto register_member_server_method = [](auto &&...) { return 0; };                         \
+                (void)m_type, (void)m_class_name, (void)m_server_name, (void)m_server_instance;             \
+                (void)register_member_service_method, (void)register_member_server_method;                  \
+                __VA_ARGS__;                                                                                \
+            }                                                                                               \
         };                                                                                                  \
         template <>                                                                                         \
         inline FieldType get_type_value<TP>() {                                                             \
@@ -501,6 +1167,8 @@ int register_member_field(int type, std::string class_name, std::string field_na
         info1.class_id = g_class_id++;
         info1.instance_manager = std::make_shared<TypedInstanceManager<TP>>(info1.class_id);
         info1.local = true;
+        info1.plan = get_type_plan(class_name);
+        info1.plan->size = sizeof(TP);
         g_all_types[class_name] = info1;
         assert(field_ref == 0);
         assert(!info1.type_name.empty());
@@ -520,13 +1188,26 @@ int register_member_field(int type, std::string class_name, std::string field_na
         info.size = sizeof(F);
         info.local = true;
         g_all_types[class_name].fields[field_name] = info;
+
+        FieldPlan field;
+        field.field_name = field_name;
+        field.field_type = info.field_type;
+        field.id_value = id;
+        field.offset = info.offset;
+        // Json fields point to the shared DYNAMIC_OBJECT plan, no lookup at write time
+        if (info.field_type == FieldType::Complex) {
+            field.child = get_type_plan(info.field_type_str).get();
+        } else if (info.field_type == FieldType::Json) {
+            field.child = get_type_plan(DYNAMIC_OBJECT).get();
+        }
+        add_plan_field(g_all_types[class_name].plan.get(), field);
     }
     return 0;
 }
 
-template <class SR, class RES, class REQ>
+template <class FN>
 int register_member_service_method(int type, std::string class_name, std::string method_name, int id,
-                                   RES (SR::*dummy)(REQ)) {
+                                   FN dummy) {
     assert(type == 2 || type == 3);
     if (g_all_services.find(class_name) == g_all_services.end()) {
         ServiceInfo info1;
@@ -539,8 +1220,8 @@ int register_member_service_method(int type, std::string class_name, std::string
     if (g_all_services[class_name].methods.find(method_name) == g_all_services[class_name].methods.end()) {
         auto info = MethodInfo();
         info.method_name = method_name;
-        info.request_type = get_class_name<REQ>();
-        info.response_type = get_class_name<RES>();
+        info.request_type = get_class_name<typename MethodTraits<FN>::request_type>();
+        info.response_type = get_class_name<typename MethodTraits<FN>::response_type>();
         info.id_value = id;
         info.handler = method_name;
         info.local = true;
@@ -549,10 +1230,10 @@ int register_member_service_method(int type, std::string class_name, std::string
     return 0;
 }
 
-template <class SR, class RES, class REQ>
+template <class SR, class FN>
 int register_member_server_method(int type, std::string class_name, std::string server_name,
                                   SR* server_instance, std::string method_name, int id,
-                                  RES (SR::*method_pointer)(REQ)) {
+                                  FN method_pointer) {
     assert(type == 3);
     if (g_all_servers.find(class_name) == g_all_servers.end()) {
         ServerInfo info1;
@@ -565,14 +1246,14 @@ int register_member_server_method(int type, std::string class_name, std::string
     if (g_all_servers[class_name].methods.find(method_name) == g_all_servers[class_name].methods.end()) {
         auto info = MethodInfo();
         info.method_name = method_name;
-        info.request_type = get_class_name<REQ>();
-        info.response_type = get_class_name<RES>();
+        info.request_type = get_class_name<typename MethodTraits<FN>::request_type>();
+        info.response_type = get_class_name<typename MethodTraits<FN>::response_type>();
         info.id_value = id;
         info.handler = method_name;
         info.local = true;
-        typedef RES (ServerBase::*FN)(REQ);
-        auto ptr2 = reinterpret_cast<FN>(method_pointer);
-        info.function_manager = std::make_shared<TypedFunctionManager<REQ, RES>>(ptr2);
+        typedef typename MethodTraits<FN>::function_manager FM;
+        auto ptr2 = reinterpret_cast<typename FM::FN>(method_pointer);
+        info.function_manager = std::make_shared<FM>(ptr2);
         g_all_servers[class_name].methods[method_name] = info;
     }
 
@@ -622,14 +1303,196 @@ nlohmann::json service(std::string server_name, SR* server_instance) {
     return result;
 }
 
+// Compile-time counterparts of assign_values/assign_binary, generated from the $rpcclass field list
+// through TypedClassManager<TP>::visit_fields. Same JSON keys and BINARY wire format as the runtime
+// TypePlan path, which remains in use for type-erased calls (_incoming_call, construct_item by name).
+// Remote only fields are not part of the local layout and are skipped when reading.
+template <class TP>
+void assign_static(TP &obj, nlohmann::json &json_data, int target);
+template <class TP>
+void write_static(TP &obj, std::vector<uint8_t> &out);
+template <class TP>
+bool read_static(TP &obj, const uint8_t *pos, const uint8_t *end);
+
+inline void assign_static_value(int &value, nlohmann::json &item, int target) {
+    if (target == 0) {
+        item.get_to(value);
+    } else {
+        item = value;
+    }
+}
+
+inline void assign_static_value(float &value, nlohmann::json &item, int target) {
+    if (target == 0) {
+        item.get_to(value);
+    } else {
+        item = value;
+    }
+}
+
+inline void assign_static_value(std::string &value, nlohmann::json &item, int target) {
+    if (target == 0) {
+        item.get_to(value);
+    } else {
+        item = value;
+    }
+}
+
+inline void assign_static_value(nlohmann::json &value, nlohmann::json &item, int target) {
+    if (target == 0) {
+        value = item;
+    } else {
+        item = value;
+    }
+}
+
+template <class TP>
+void assign_static_value(TP &value, nlohmann::json &item, int target) {
+    if (target == 1) {
+        item = nlohmann::json();
+    }
+    assign_static(value, item, target);
+}
+
+inline void write_static_value(int value, int id, std::vector<uint8_t> &out) {
+    write_int_field(out, id, value);
+}
+
+inline void write_static_value(float value, int id, std::vector<uint8_t> &out) {
+    write_float_field(out, id, value);
+}
+
+inline void write_static_value(std::string &value, int id, std::vector<uint8_t> &out) {
+    write_string_field(out, id, value);
+}
+
+template <class TP>
+void write_static_value(TP &value, int id, std::vector<uint8_t> &out) {
+    auto start = begin_length_field(out, id);
+    write_static(value, out);
+    write_length(out, start);
+}
+
+inline bool read_static_value(int &value, const WireField &field) {
+    read_int_field(field, value);
+    return true;
+}
+
+inline bool read_static_value(float &value, const WireField &field) {
+    read_float_field(field, value);
+    return true;
+}
+
+inline bool read_static_value(std::string &value, const WireField &field) {
+    read_string_field(field, value);
+    return true;
+}
+
+template <class TP>
+bool read_static_value(TP &value, const WireField &field) {
+    if (field.wire_type != WIRE_LENGTH) {
+        // Wire type mismatch, keep default
+        return true;
+    }
+    return read_static(value, field.value_pos, field.value_pos + field.length);
+}
+
+template <class TP>
+void assign_static(TP &obj, nlohmann::json &json_data, int target) {
+    if constexpr (std::is_same_v<TP, nlohmann::json>) {
+        assign_static_value(obj, json_data, target);
+    } else {
+        TypedClassManager<TP>::visit_fields(&obj, [&json_data, target](const char *field_name, int id, auto &value) {
+            if (target == 0) {
+                auto item = json_data.find(field_name);
+                if (item != json_data.end()) {
+                    assign_static_value(value, *item, 0);
+                }
+            } else {
+                assign_static_value(value, json_data[field_name], 1);
+            }
+        });
+    }
+}
+
+template <class TP>
+void write_static(TP &obj, std::vector<uint8_t> &out) {
+    if constexpr (std::is_same_v<TP, nlohmann::json>) {
+        write_dynamic(out, obj);
+    } else {
+        TypedClassManager<TP>::visit_fields(&obj, [&out](const char *field_name, int id, auto &value) {
+            write_static_value(value, id, out);
+        });
+    }
+}
+
+// One entry per field id, built from the field list on first use, like TypePlan::id_index
+struct StaticFieldReader {
+    int offset{-1};
+    bool (*read)(uint8_t *field_data, const WireField &field){nullptr};
+};
+
+template <class TP>
+std::vector<StaticFieldReader> get_static_readers(TP &obj) {
+    std::vector<StaticFieldReader> result;
+    TypedClassManager<TP>::visit_fields(&obj, [&obj, &result](const char *field_name, int id, auto &value) {
+        typedef std::remove_reference_t<decltype(value)> V;
+        if (id >= result.size()) {
+            result.resize(id + 1);
+        }
+        result[id].offset = (int)(reinterpret_cast<uint8_t *>(&value) - reinterpret_cast<uint8_t *>(&obj));
+        result[id].read = [](uint8_t *field_data, const WireField &field) {
+            return read_static_value(*reinterpret_cast<V *>(field_data), field);
+        };
+    });
+    return result;
+}
+
+template <class TP>
+bool read_static(TP &obj, const uint8_t *pos, const uint8_t *end) {
+    if constexpr (std::is_same_v<TP, nlohmann::json>) {
+        return read_dynamic(pos, end, obj);
+    } else {
+        static const auto readers = get_static_readers(obj);
+        while (pos < end) {
+            WireField field;
+            if (!read_wire_field(pos, end, field)) {
+                return false;
+            }
+            // Remote only fields and unknown ids are skipped
+            if (field.id_value >= readers.size() || !readers[field.id_value].read) {
+                continue;
+            }
+            auto &reader = readers[field.id_value];
+            if (!reader.read(reinterpret_cast<uint8_t *>(&obj) + reader.offset, field)) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+template <class TP>
+bool assign_static_binary(TP &obj, std::vector<uint8_t> &data, int target) {
+    if (target == 0) {
+        if (data.size() == 0 || data[0] != BINARY_MARKER) {
+            return false;
+        }
+        return read_static(obj, &data[1], &data[0] + data.size());
+    } else {
+        data.resize(0);
+        data.push_back(BINARY_MARKER);
+        write_static(obj, data);
+        return true;
+    }
+}
+
 void construct_item(std::string type_name, std::vector<uint8_t> &data);
 
 template <class TP>
 TP construct_item(nlohmann::json json_data) {
-    auto &type_info = g_all_types[type<TP>()];
-    assert(type_info.size == sizeof(TP));
     TP obj_data;
-    assign_values(type_info.type_name, reinterpret_cast<uint8_t *>(&obj_data), 0, sizeof(TP), json_data, 0);
+    assign_static(obj_data, json_data, 0);
     return obj_data;
 }
 
@@ -637,15 +1500,19 @@ void destroy_item(std::string type_name, std::vector<uint8_t> &data);
 
 template <class TP>
 nlohmann::json construct_json(TP &data) {
-    auto &type_info = g_all_types[type<TP>()];
-    assert(type_info.size == sizeof(TP));
     nlohmann::json json_data;
-    assign_values(type_info.type_name, reinterpret_cast<uint8_t *>(&data), 0, sizeof(TP), json_data, 1);
+    assign_static(data, json_data, 1);
     return json_data;
 }
 
 void assign_values(std::string type_name, uint8_t *res_data, int res_offset, int res_size, nlohmann::json &data,
                    int target);
+bool assign_binary(std::string type_name, uint8_t *res_data, int res_offset, int res_size, std::vector<uint8_t> &data,
+                   int target);
+bool read_binary(std::string type_name, uint8_t *res_data, int res_offset, int res_size, std::span<const uint8_t> data);
+void assign_values(const TypePlan &plan, uint8_t *res_data, nlohmann::json &data, int target);
+bool assign_binary(const TypePlan &plan, uint8_t *res_data, std::vector<uint8_t> &data, int target);
+bool read_binary(const TypePlan &plan, uint8_t *res_data, std::span<const uint8_t> data);
 
 template <class TP>
 std::string get_class_string(TP& data) {
@@ -680,14 +1547,28 @@ extern const std::vector<int8_t> g_base64_alphabet_rev;
 
 std::string base64_encode(const std::vector<uint8_t> &data);
 std::vector<uint8_t> base64_decode(std::string encoded);
+std::string get_text_hash(std::string_view text);
 
-std::string get_string(std::vector<uint8_t> data);
+std::string get_string(std::span<const uint8_t> data);
 std::vector<uint8_t> get_buffer(std::string str);
 std::vector<uint8_t> get_buffer_json(const std::vector<uint8_t> &data);
 std::vector<uint8_t> get_buffer_json(const nlohmann::json &data);
+std::vector<uint8_t> get_buffer_binary();
+bool is_binary_buffer(std::span<const uint8_t> data);
+std::vector<uint8_t> get_buffer_call_id(uint32_t call_id);
+uint32_t get_call_id(std::span<const uint8_t> data);
+std::vector<uint8_t> get_buffer_route_id(uint32_t route_id);
+uint32_t get_route_id(std::span<const uint8_t> data);
+std::vector<uint8_t> get_buffer_response(std::span<const uint8_t> method_frame);
+std::string get_method_label(std::span<const uint8_t> method_frame);
 std::vector<uint8_t> get_buffer(std::vector<uint8_t> a, std::vector<uint8_t> b);
 void set_buffer(std::vector<uint8_t> &dest, void *data, size_t size);
-nlohmann::json get_json(std::vector<uint8_t> data);
+int send_buffer(void *socket, std::vector<uint8_t> &data, int flags);
+int send_buffer_copy(void *socket, const std::vector<uint8_t> &data, int flags);
+void *create_context(int io_threads, const std::vector<int> &affinity);
+void *get_shared_context(int io_threads, const std::vector<int> &affinity);
+std::string get_inproc_address(std::string prefix);
+nlohmann::json get_json(std::span<const uint8_t> data);
 
 template <typename T, typename P>
 std::shared_ptr<T> find(std::vector<std::shared_ptr<T>> &list, P pred) {
@@ -7,18 +7,40 @@
  *          connect
  *          cast
  *          server_thread
+ *          worker_thread
  *          client_thread
  *          client_call
+ *          client_call_async
+ *          broadcast_call
  *          forward_call
  *          server_call
+ *          server_call_async
+ *          co_server_call
+ *          co_client_call
+ *          _server_call
+ *          _server_call_async
+ *          _get_method_frame
  *          _incoming_call
+ *          _post_response
+ *          _add_error
  *          _add_types
  *          _add_server
+ *          _add_routes
+ *          _resolve_route
+ *          _read_routes
+ *          _find_route
+ *          _add_route_error
  *          _get_app_info
+ *          _get_declarations
+ *          _get_schema_hash
+ *          _get_sync_metadata
+ *          _get_schema_diff
  *          _get_schema
  *          _set_schema
  *          _assign_values
+ *          _assign_binary
  *          _sync_with_server
+ *          _sync_with_hash
  *          _sync_with_client
  *          _find_new_fields
  *          _find_new_methods
@@ -37,9 +59,11 @@
 #include "client_socket.hpp"
 #include "server_socket.hpp"
 
+#include <set>
+
 namespace nrpc_cpp {
 
-RoutingSocket::RoutingSocket(nlohmann::json options_) {
+RoutingSocket::RoutingSocket(nlohmann::json options_, void* zmq_context) {
     RoutingSocketOptions_ options;
     options.type = (SocketType)(int)options_["type"];
     options.protocol = options_.contains("protocol") ? (ProtocolType)(int)options_["protocol"] : ProtocolType::TCP;
@@ -47,13 +71,28 @@ RoutingSocket::RoutingSocket(nlohmann::json options_) {
     options.name = options_.contains("name") ? (std::string)options_["name"] : "";
     options.types = options_.contains("types") ? options_["types"] : nlohmann::json::array();
     options.port = options_.contains("port") ? (int)options_["port"] : 0;
+    options.workers = options_.contains("workers") ? (int)options_["workers"] : 0;
+    options.shared_context = options_.contains("shared_context") ? (bool)options_["shared_context"] : true;
+    options.io_threads = options_.contains("io_threads") ? (int)options_["io_threads"] : 1;
+    options.affinity = options_.contains("affinity") ? options_["affinity"].get<std::vector<int>>() : std::vector<int>();
+    options.multiplex = options_.contains("multiplex") ? (bool)options_["multiplex"] : false;
 
     socket_type_ = options.type;
     protocol_type_ = options.protocol;
     format_type_ = options.format;
     ip_address_ = "";
     port_ = options.port;
+    worker_count_ = options.workers;
     socket_name_ = options.name;
+    multiplex_ = options.multiplex;
+    if (zmq_context) {
+        zmq_context_ = zmq_context;
+    } else if (options.shared_context) {
+        zmq_context_ = get_shared_context(options.io_threads, options.affinity);
+    } else {
+        zmq_context_ = create_context(options.io_threads, options.affinity);
+        owns_context_ = true;
+    }
     processor_.reset();
     is_ready_ = false;
     is_alive_ = true;
@@ -68,6 +107,7 @@ RoutingSocket::RoutingSocket(nlohmann::json options_) {
         info.class_id = g_class_id++;
         info.instance_manager = std::make_shared<TypedInstanceManager<nlohmann::json>>(info.class_id);
         info.local = true;
+        info.plan = get_type_plan(DYNAMIC_OBJECT);
         g_all_types[DYNAMIC_OBJECT] = info;
     }
 
@@ -75,21 +115,36 @@ RoutingSocket::RoutingSocket(nlohmann::json options_) {
     assert(known_types_[DYNAMIC_OBJECT].instance_manager);
 
     _add_types(options.types);
+    _add_routes();
+    schema_hash_ = _get_schema_hash();
 }
 
-RoutingSocket::~RoutingSocket() { close(); }
+RoutingSocket::~RoutingSocket() {
+    close();
+
+    // Shared and user supplied contexts outlive the socket
+    if (owns_context_ && zmq_context_) {
+        zmq_ctx_term(zmq_context_);
+    }
+    zmq_context_ = 0;
+}
 
 void RoutingSocket::bind(std::string ip_address, int port) {
     assert(socket_type_ == SocketType::BIND);
 
     ip_address_ = ip_address;
     port_ = port;
-    server_socket_ = std::make_shared<ServerSocket>(ip_address, port, port + 10000, socket_name_);
+    server_socket_ =
+        std::make_shared<ServerSocket>(ip_address, port, multiplex_ ? 0 : port + 10000, socket_name_, zmq_context_);
+    server_socket_->add_metadata(_get_sync_metadata());
 
     assert(server_socket_->get_client_ids().size() == 0);
 
     server_socket_->bind();
     processor_ = std::make_shared<std::thread>([this]() { server_thread(); });
+    for (int j = 0; j < worker_count_; j++) {
+        workers_.push_back(std::make_shared<std::thread>([this]() { worker_thread(); }));
+    }
 }
 
 void RoutingSocket::connect(std::string ip_address, int port, bool wait, bool sync) {
@@ -97,15 +152,19 @@ void RoutingSocket::connect(std::string ip_address, int port, bool wait, bool sy
 
     ip_address_ = ip_address;
     port_ = port;
-    client_socket_ = std::make_shared<ClientSocket>(ip_address, port, port + 10000, socket_name_);
+    client_socket_ =
+        std::make_shared<ClientSocket>(ip_address, port, multiplex_ ? 0 : port + 10000, socket_name_, zmq_context_);
+    client_socket_->add_metadata(_get_sync_metadata());
 
     do_sync_ = sync;
     processor_ = std::make_shared<std::thread>([this]() { client_thread(); });
+    for (int j = 0; j < worker_count_; j++) {
+        workers_.push_back(std::make_shared<std::thread>([this]() { worker_thread(); }));
+    }
 
     if (wait) {
-        while (is_alive_ && !is_ready_) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        }
+        std::unique_lock<std::mutex> lock(ready_lock_);
+        ready_changed_.wait(lock, [this]() { return !is_alive_ || is_ready_; });
     }
 }
 
@@ -116,75 +175,166 @@ void RoutingSocket::server_thread() {
     assert(socket_type_ == BIND);
     while (is_alive_) {
         int client_id = 0;
-        std::vector<std::vector<uint8_t>> req;
+        std::vector<MessageFrame> req;
         server_socket_->recv_norm(client_id, req);
         if (!is_alive_) {
             break;
         }
-        assert(req.size() == 2);
-        auto method_name = req[0];
-        auto command_parameters = get_json(req[1]);
+        assert(req.size() == 2 || req.size() == 3);
+        auto is_routing_message = req[0] == RoutingMessage::GetAppInfo || req[0] == RoutingMessage::GetSchema ||
+                                  req[0] == RoutingMessage::SetSchema;
+
+        // Application calls go to the worker pool, replies come back through post_norm
+        if (worker_count_ > 0 && !is_routing_message) {
+            std::lock_guard<std::mutex> lock(pending_lock_);
+            pending_requests_.push_back(MessageInfo());
+            pending_requests_.back().client_id = client_id;
+            pending_requests_.back().frames.swap(req);
+            pending_ready_.notify_one();
+            continue;
+        }
 
         std::vector<std::vector<uint8_t>> resp;
         resp.resize(2);
-        resp[0] = get_buffer(get_buffer("response:"), method_name);
+        resp[0] = get_buffer_response(req[0]);
+        if (req.size() == 3) {
+            resp.push_back(req[2].get_buffer());
+        }
 
         // print(f"{Fore.BLUE}server{Fore.RESET} received request")
         // print(f"{Fore.BLUE}server{Fore.RESET} responding")
 
-        if (method_name == RoutingMessage::GetAppInfo) {
+        if (req[0] == RoutingMessage::GetAppInfo) {
+            std::shared_lock<std::shared_mutex> lock(schema_lock_);
+            auto command_parameters = get_json(req[1]);
             _get_app_info(command_parameters, resp[1]);
-        } else if (method_name == RoutingMessage::GetSchema) {
+        } else if (req[0] == RoutingMessage::GetSchema) {
+            std::shared_lock<std::shared_mutex> lock(schema_lock_);
+            auto command_parameters = get_json(req[1]);
             _get_schema(command_parameters, resp[1], client_id);
-        } else if (method_name == RoutingMessage::SetSchema) {
-            _set_schema(command_parameters, resp[1]);
+        } else if (req[0] == RoutingMessage::SetSchema) {
+            std::unique_lock<std::shared_mutex> lock(schema_lock_);
+            auto command_parameters = get_json(req[1]);
+            _set_schema(command_parameters, resp[1], client_id);
         } else {
-            _incoming_call(get_string(method_name), command_parameters, resp[1]);
+            auto reply = [this, client_id, resp](std::vector<uint8_t>& res) mutable {
+                resp[1].swap(res);
+                server_socket_->post_norm(client_id, resp);
+            };
+            auto done = _incoming_call(req[0], req[1], resp[1], reply);
+            if (!done) {
+                continue;
+            }
         }
 
         server_socket_->send_norm(client_id, resp);
     }
 }
 
+// Serves application calls for server_thread and reverse calls for client_thread
+void RoutingSocket::worker_thread() {
+    while (true) {
+        MessageInfo item;
+        {
+            std::unique_lock<std::mutex> lock(pending_lock_);
+            pending_ready_.wait(lock, [this]() { return !is_alive_ || pending_requests_.size(); });
+            if (!is_alive_) {
+                break;
+            }
+            item = std::move(pending_requests_.front());
+            pending_requests_.pop_front();
+        }
+
+        auto& req = item.frames;
+        std::vector<std::vector<uint8_t>> resp;
+        resp.resize(2);
+        resp[0] = get_buffer_response(req[0]);
+        if (req.size() == 3) {
+            resp.push_back(req[2].get_buffer());
+        }
+        auto client_id = item.client_id;
+        auto reply = [this, client_id, resp](std::vector<uint8_t>& res) mutable {
+            resp[1].swap(res);
+            _post_response(client_id, resp);
+        };
+        auto done = _incoming_call(req[0], req[1], resp[1], reply);
+        if (!done) {
+            continue;
+        }
+
+        _post_response(item.client_id, resp);
+    }
+}
+
 void RoutingSocket::client_thread() {
     assert(socket_type_ == CONNECT);
     client_socket_->connect();
 
-    if (do_sync_) {
-        assert(client_socket_->is_validated());
-        _sync_with_server();
-        _sync_with_client();
+    // Connect returns early when the socket is closed or the server lost during the handshake
+    if (do_sync_ && client_socket_->is_validated()) {
+        if (client_socket_->get_server_metadata().contains("schema_hash")) {
+            _sync_with_hash();
+        } else {
+            _sync_with_server();
+            _sync_with_client();
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(ready_lock_);
+        is_ready_ = true;
+        ready_changed_.notify_all();
     }
-    is_ready_ = true;
 
     while (is_alive_) {
-        std::vector<std::vector<uint8_t>> req;
-        client_socket_->recv_rev(req);
-        if (!is_alive_) {
+        std::vector<MessageFrame> req;
+        // Nothing more arrives once the server is lost
+        if (!client_socket_->recv_rev(req) || !is_alive_) {
             break;
         }
 
-        auto method_name = req[0];
-        auto command_parameters = get_json(req[1]);
+        auto is_routing_message = req[0] == RoutingMessage::GetAppInfo || req[0] == RoutingMessage::GetSchema ||
+                                  req[0] == RoutingMessage::SetSchema;
+
+        // Reverse calls carry call ids, the server matches responses out of order
+        if (worker_count_ > 0 && !is_routing_message) {
+            std::lock_guard<std::mutex> lock(pending_lock_);
+            pending_requests_.push_back(MessageInfo());
+            pending_requests_.back().frames.swap(req);
+            pending_ready_.notify_one();
+            continue;
+        }
+
         std::vector<std::vector<uint8_t>> resp;
         resp.resize(2);
-        resp[0] = get_buffer(get_buffer("response:"), method_name);
+        resp[0] = get_buffer_response(req[0]);
+        if (req.size() == 3) {
+            resp.push_back(req[2].get_buffer());
+        }
 
         // Reverse client is bright red
         // print(f"{Fore.RED}client:{socket.client_id}{Fore.RESET} received request, {method_name}")
         // print(f"{Fore.RED}client:{socket.client_id}{Fore.RESET} responding")
 
         if (req[0] == RoutingMessage::GetAppInfo) {
+            auto command_parameters = get_json(req[1]);
             _get_app_info(command_parameters, resp[1]);
             // check_serializable(resp)
         } else if (req[0] == RoutingMessage::GetSchema) {
+            auto command_parameters = get_json(req[1]);
             _get_schema(command_parameters, resp[1], 0);
             // check_serializable(resp)
         } else if (req[0] == RoutingMessage::SetSchema) {
             assert(false);
         } else {
-            _incoming_call(get_string(method_name), command_parameters, resp[1]);
+            auto reply = [this, resp](std::vector<uint8_t>& res) mutable {
+                resp[1].swap(res);
+                client_socket_->send_rev(resp);
+            };
+            auto done = _incoming_call(req[0], req[1], resp[1], reply);
             // check_serializable(resp)
+            if (!done) {
+                continue;
+            }
         }
 
         client_socket_->send_rev(resp);
@@ -193,33 +343,159 @@ void RoutingSocket::client_thread() {
 
 nlohmann::json RoutingSocket::client_call(int client_id, std::string method_name, nlohmann::json params) {
     assert(socket_type_ == BIND);
-    assert(find_contains(server_socket_->get_client_ids(), client_id));
+    assert(server_socket_->has_client(client_id));
 
     // Server rev is dark red
     // print(f"{Style.DIM}{Fore.RED}server{Fore.RESET}{Style.NORMAL} sending request")
 
     std::vector<uint8_t> res;
-    {
-        std::lock_guard<std::recursive_mutex> lock(server_socket_->get_request_lock());
-        std::vector<std::vector<uint8_t>> req;
-        req.resize(2);
-        req[0] = get_buffer(method_name);
-        req[1] = get_buffer_json(params);
-        server_socket_->send_rev(client_id, req);
-        server_socket_->recv_rev(client_id, res);
+    std::vector<std::vector<uint8_t>> req;
+    req.resize(2);
+    req[0] = _get_method_frame(method_name, client_id);
+    req[1] = get_buffer_json(params);
+    auto call_id = server_socket_->send_rev(client_id, req);
+    if (!server_socket_->recv_rev(call_id, res)) {
+        // Closed or lost client, same error as server_call and the async path
+        throw CallError(method_name);
     }
     return get_json(res);
 }
 
+std::future<nlohmann::json> RoutingSocket::client_call_async(int client_id, std::string method_name,
+                                                             nlohmann::json params) {
+    auto promise = std::make_shared<std::promise<nlohmann::json>>();
+    auto result = promise->get_future();
+    client_call_async(client_id, method_name, params, [promise](nlohmann::json res, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(res);
+        }
+    });
+    return result;
+}
+
+void RoutingSocket::client_call_async(int client_id, std::string method_name, nlohmann::json params,
+                                      std::function<void(nlohmann::json, std::exception_ptr)> callback) {
+    assert(socket_type_ == BIND);
+    assert(server_socket_->has_client(client_id));
+
+    std::vector<std::vector<uint8_t>> req;
+    req.resize(2);
+    req[0] = _get_method_frame(method_name, client_id);
+    req[1] = get_buffer_json(params);
+    server_socket_->send_rev(client_id, req, [method_name, callback](std::vector<uint8_t>& res) {
+        if (!res.size()) {
+            callback(nlohmann::json::object(), std::make_exception_ptr(CallError(method_name)));
+            return;
+        }
+        // Runs on the I/O thread, a malformed reply is reported to the callback and never thrown here
+        nlohmann::json result;
+        try {
+            result = get_json(res);
+        } catch (...) {
+            callback(nlohmann::json::object(), std::current_exception());
+            return;
+        }
+        callback(result, nullptr);
+    });
+}
+
+std::map<int, nlohmann::json> RoutingSocket::broadcast_call(std::string method_name, nlohmann::json params,
+                                                            std::function<bool(int)> client_filter, int timeout_ms) {
+    assert(socket_type_ == BIND);
+    assert(timeout_ms > 0);
+
+    // Payload is encoded once, each client gets a copy of the same bytes
+    auto params_data = get_buffer_json(params);
+    std::vector<std::pair<int, uint32_t>> calls;
+    for (auto client_id : server_socket_->get_client_ids()) {
+        if (client_filter && !client_filter(client_id)) {
+            continue;
+        }
+        std::vector<std::vector<uint8_t>> req = {_get_method_frame(method_name, client_id), params_data};
+        calls.push_back({client_id, server_socket_->send_rev(client_id, req)});
+    }
+
+    // All calls are in flight, gathering waits as long as the slowest client or until the deadline
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    std::map<int, nlohmann::json> result;
+    for (auto& call : calls) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        auto remaining_ms = std::max(1, (int)left.count());
+        std::vector<uint8_t> res;
+        if (!server_socket_->recv_rev(call.second, res, remaining_ms)) {
+            continue;
+        }
+        try {
+            result[call.first] = get_json(res);
+        } catch (const nlohmann::json::exception& e) {
+            std::cerr << boost::str(boost::format("Malformed broadcast reply: %1%, %2%") % call.first % e.what())
+                      << std::endl;
+        }
+    }
+    return result;
+}
+
+CallAwaiter<nlohmann::json> RoutingSocket::co_client_call(int client_id, std::string method_name,
+                                                          nlohmann::json params) {
+    return CallAwaiter<nlohmann::json>([this, client_id, method_name, params](std::function<void(nlohmann::json, std::exception_ptr)> done) {
+        client_call_async(client_id, method_name, params, done);
+    });
+}
+
 nlohmann::json RoutingSocket::forward_call(int client_id, std::string method_name, nlohmann::json params) {
-    return server_call(get_string(ServerMessage::ForwardCall), nlohmann::json({
-                                                                   {"client_id", client_id},
-                                                                   {"method_name", method_name},
-                                                                   {"method_params", params},
-                                                               }));
+    // Route is part of the method frame so the server relays the params without parsing them
+    auto route = boost::str(boost::format("%1%%2%:%3%") % get_string(ServerMessage::ForwardTo) % client_id % method_name);
+    auto req = get_buffer_json(params);
+    return get_json(_server_call(route, req));
 }
 
 nlohmann::json RoutingSocket::server_call(std::string method_name, nlohmann::json params) {
+    auto req = get_buffer_json(params);
+    return get_json(_server_call(method_name, req));
+}
+
+std::future<nlohmann::json> RoutingSocket::server_call_async(std::string method_name, nlohmann::json params) {
+    auto promise = std::make_shared<std::promise<nlohmann::json>>();
+    auto result = promise->get_future();
+    server_call_async(method_name, params, [promise](nlohmann::json res, std::exception_ptr error) {
+        if (error) {
+            promise->set_exception(error);
+        } else {
+            promise->set_value(res);
+        }
+    });
+    return result;
+}
+
+void RoutingSocket::server_call_async(std::string method_name, nlohmann::json params,
+                                      std::function<void(nlohmann::json, std::exception_ptr)> callback) {
+    auto req = get_buffer_json(params);
+    _server_call_async(method_name, req, [method_name, callback](std::vector<uint8_t>& res) {
+        if (!res.size()) {
+            callback(nlohmann::json::object(), std::make_exception_ptr(CallError(method_name)));
+            return;
+        }
+        // Runs on the I/O thread, a malformed reply is reported to the callback and never thrown here
+        nlohmann::json result;
+        try {
+            result = get_json(res);
+        } catch (...) {
+            callback(nlohmann::json::object(), std::current_exception());
+            return;
+        }
+        callback(result, nullptr);
+    });
+}
+
+CallAwaiter<nlohmann::json> RoutingSocket::co_server_call(std::string method_name, nlohmann::json params) {
+    return CallAwaiter<nlohmann::json>([this, method_name, params](std::function<void(nlohmann::json, std::exception_ptr)> done) {
+        server_call_async(method_name, params, done);
+    });
+}
+
+std::vector<uint8_t> RoutingSocket::_server_call(std::string method_name, std::vector<uint8_t>& params) {
     assert(socket_type_ == CONNECT);
 
     call_count_ += 1;
@@ -227,116 +503,159 @@ nlohmann::json RoutingSocket::server_call(std::string method_name, nlohmann::jso
     // Server rev is dark red
     // print(f"{Style.DIM}{Fore.RED}server{Fore.RESET}{Style.NORMAL} sending request")
 
+    // Calls from several threads are pipelined and matched by call id
     std::vector<uint8_t> res;
-    {
-        std::lock_guard<std::recursive_mutex> lock(client_socket_->get_request_lock());
-        std::vector<std::vector<uint8_t>> req;
-        req.resize(2);
-        req[0] = get_buffer(method_name);
-        req[1] = get_buffer_json(params);
-        client_socket_->send_norm(req);
-        auto rc = client_socket_->recv_norm(res);
-        assert(rc);
+    std::vector<std::vector<uint8_t>> req;
+    req.resize(2);
+    req[0] = _get_method_frame(method_name, 0);
+    req[1] = params;
+    auto call_id = client_socket_->send_norm(req);
+    if (!client_socket_->recv_norm(call_id, res)) {
+        // Closed or lost server, same error as the async path
+        throw CallError(method_name);
     }
-    return get_json(res);
+    return res;
 }
 
-// template<class RQ, class RS>
-// RS server_call(std::string method_name, RQ request, std::shared_ptr<RS> response_);
-
-void RoutingSocket::_incoming_call(std::string method_name, nlohmann::json request_data,
-                                   std::vector<uint8_t>& response_data) {
-    std::vector<std::string> parts;
-    boost::algorithm::split(parts, method_name, boost::is_any_of("."));
+void RoutingSocket::_server_call_async(std::string method_name, std::vector<uint8_t>& params,
+                                       std::function<void(std::vector<uint8_t>&)> callback) {
+    assert(socket_type_ == CONNECT);
 
-    if (known_services_.find(parts[0]) == known_services_.end()) {
-        std::cerr << "Missing service! " << method_name << std::endl;
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
-    }
-    if (known_servers_.find(parts[0]) == known_servers_.end()) {
-        auto& service_info = known_services_[parts[0]];
-        if (service_info.service_errors.empty()) {
-            service_info.service_errors += boost::str(boost::format("Missing server! %1%") % method_name);
-        }
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
-    }
+    call_count_ += 1;
 
-    auto& service_info = known_services_[parts[0]];
-    auto& server = known_servers_[parts[0]];
+    std::vector<std::vector<uint8_t>> req;
+    req.resize(2);
+    req[0] = _get_method_frame(method_name, 0);
+    req[1] = params;
+    client_socket_->send_norm(req, callback);
+}
 
-    if (service_info.methods.find(parts[1]) == service_info.methods.end()) {
-        if (service_info.service_errors.empty()) {
-            service_info.service_errors += boost::str(boost::format("Missing method! %1%") % method_name);
-        }
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
+// Peers that published route ids in their schema get the compact frame, see get_buffer_route_id
+std::vector<uint8_t> RoutingSocket::_get_method_frame(const std::string& method_name, int client_id) {
+    std::shared_lock<std::shared_mutex> lock(schema_lock_);
+    std::unordered_map<std::string, uint32_t>* routes = &server_routes_;
+    std::shared_ptr<ClientInfo> client;
+    if (socket_type_ == SocketType::BIND) {
+        client = server_socket_->get_client_info(client_id);
+        routes = client ? &client->routes : 0;
     }
-    if (server.methods.find(parts[1]) == server.methods.end()) {
-        if (service_info.service_errors.empty()) {
-            service_info.service_errors += boost::str(boost::format("Missing server methods! %1%") % method_name);
+    if (routes) {
+        auto found = routes->find(method_name);
+        if (found != routes->end()) {
+            return get_buffer_route_id(found->second);
         }
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
     }
+    return get_buffer(method_name);
+}
 
-    auto& info3 = server.methods[parts[1]];
+// template<class RQ, class RS>
+// RS server_call(std::string method_name, RQ request, std::shared_ptr<RS> response_);
 
-    if (known_types_.find(info3.request_type) == known_types_.end()) {
-        if (info3.method_errors.empty()) {
-            info3.method_errors +=
-                boost::str(boost::format("Unknown method request type! %1%, %2%") % method_name % info3.request_type);
-        }
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
-    }
-    if (known_types_.find(info3.response_type) == known_types_.end()) {
-        if (info3.method_errors.empty()) {
-            info3.method_errors +=
-                boost::str(boost::format("Unknown method response type! %1%, %2%") % method_name % info3.response_type);
-        }
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
-    }
-    if (!info3.method_errors.empty()) {
-        response_data = get_buffer_json(nlohmann::json::object());
-        return;
+bool RoutingSocket::_incoming_call(std::span<const uint8_t> method_frame, std::span<const uint8_t> request_data,
+                                   std::vector<uint8_t>& response_data,
+                                   std::function<void(std::vector<uint8_t>&)> callback) {
+    // Responses use the same format as the request
+    auto is_binary = is_binary_buffer(request_data);
+    std::shared_lock<std::shared_mutex> lock(schema_lock_);
+
+    auto route = _find_route(method_frame);
+    if (!route) {
+        _add_route_error(method_frame);
+        response_data = is_binary ? get_buffer_binary() : get_buffer_json(nlohmann::json::object());
+        return true;
     }
 
-    assert(known_types_[info3.request_type].class_id);
-    assert(known_types_[info3.response_type].class_id);
-
-    auto req_type = known_types_[info3.request_type];  // TODO!
-    auto res_type = known_types_[info3.response_type];
-    std::vector<uint8_t> req_data;
-    std::vector<uint8_t> res_data;
-    req_data.resize(req_type.size);
-    res_data.resize(res_type.size);
-
-    assert(req_type.type_name != "");
-    assert(res_type.type_name != "");
-    assert(req_type.class_id == req_type.instance_manager->_get_class_id());
-    assert(res_type.class_id == res_type.instance_manager->_get_class_id());
-
-    nrpc_cpp::construct_item(req_type.type_name, req_data);
-    nrpc_cpp::construct_item(res_type.type_name, res_data);
-
+    auto& method_name = route->method_name;
+    auto& info3 = *route->method;
+    if (!info3.method_errors.empty() || !route->request_type) {
+        response_data = is_binary ? get_buffer_binary() : get_buffer_json(nlohmann::json::object());
+        return true;
+    }
     assert(info3.local);
-    assert(req_type.local);
-    assert(res_type.local);
-
-    _assign_values(info3.request_type, &req_data[0], 0, req_data.size(), request_data, 0);
 
-    info3.function_manager->invoke_function(server.instance, req_data, res_data);
+    // Pooled items, steady state calls allocate nothing for the request and response objects.
+    // Both go back to the pool when decoding or the handler throws
+    auto res_manager = route->response_type->instance_manager.get();
+    PooledItem req_item(route->request_type->instance_manager.get());
+    PooledItem res_item(res_manager);
+
+    // Routes are never removed, the entry outlives calls still in flight
+    auto function_manager = info3.function_manager.get();
+    auto instance = route->server->instance;
+    auto finish = [is_binary, route](uint8_t* res_data, std::vector<uint8_t>& response_data) {
+        if (is_binary) {
+            assign_binary(*route->response_plan, res_data, response_data, 1);
+        } else {
+            nlohmann::json resp;
+            assign_values(*route->response_plan, res_data, resp, 1);
+            response_data = get_buffer_json(resp);
+        }
+    };
+
+    // Malformed requests and failed handlers get the empty response in either format
+    try {
+        if (is_binary) {
+            if (!read_binary(*route->request_plan, req_item.get(), request_data)) {
+                std::cerr << "Malformed binary request! " << method_name << std::endl;
+                response_data = get_buffer_binary();
+                return true;
+            }
+        } else {
+            auto request_json = get_json(request_data);
+            assign_values(*route->request_plan, req_item.get(), request_json, 0);
+        }
+        lock.unlock();
+
+        // Awaitable handlers reply through the callback once their task returns
+        if (callback && function_manager->is_async()) {
+            // The response item is returned by the completion, which may run inline
+            auto res_data = res_item.release();
+            auto done = [is_binary, route, finish, res_manager, res_data, callback](std::exception_ptr error) {
+                std::vector<uint8_t> response_data;
+                if (error) {
+                    // Failed task, same empty response as a handler that throws
+                    try {
+                        std::rethrow_exception(error);
+                    } catch (const std::exception& e) {
+                        std::cerr << "Failed call! " << route->method_name << ", " << e.what() << std::endl;
+                    } catch (...) {
+                        std::cerr << "Failed call! " << route->method_name << std::endl;
+                    }
+                    response_data = is_binary ? get_buffer_binary() : get_buffer_json(nlohmann::json::object());
+                } else {
+                    finish(res_data, response_data);
+                }
+                res_manager->_release_item(res_data);
+                callback(response_data);
+            };
+            function_manager->invoke_async(instance, req_item.get(), res_data, done);
+            return false;
+        }
 
-    nlohmann::json resp;
-    _assign_values(info3.response_type, &res_data[0], 0, res_data.size(), resp, 1);
+        function_manager->invoke_function(instance, req_item.get(), res_item.get());
+        finish(res_item.get(), response_data);
+    } catch (const std::exception& e) {
+        std::cerr << "Failed call! " << method_name << ", " << e.what() << std::endl;
+        response_data = is_binary ? get_buffer_binary() : get_buffer_json(nlohmann::json::object());
+    }
+    return true;
+}
 
-    nrpc_cpp::destroy_item(req_type.type_name, req_data);
-    nrpc_cpp::destroy_item(res_type.type_name, res_data);
+// Both sockets queue the response for their I/O thread, safe to call from any thread
+void RoutingSocket::_post_response(int client_id, std::vector<std::vector<uint8_t>>& resp) {
+    if (socket_type_ == SocketType::BIND) {
+        server_socket_->post_norm(client_id, resp);
+    } else {
+        client_socket_->send_rev(resp);
+    }
+}
 
-    response_data = get_buffer_json(resp);
+// Error strings are shared by worker threads, only the first error is kept
+void RoutingSocket::_add_error(std::string& errors, std::string text) {
+    std::lock_guard<std::mutex> lock(errors_lock_);
+    if (errors.empty()) {
+        errors += text;
+    }
 }
 
 void RoutingSocket::_add_types(nlohmann::json types) {
@@ -390,6 +709,105 @@ void RoutingSocket::_add_server(nlohmann::json item) {
     }
 }
 
+void RoutingSocket::_add_routes() {
+    for (auto& kvp : known_servers_) {
+        auto& server = kvp.second;
+        auto& service = known_services_[kvp.first];
+        for (auto& kvp2 : server.methods) {
+            if (service.methods.find(kvp2.first) == service.methods.end()) {
+                continue;
+            }
+            RouteInfo route;
+            route.route_id = routes_.size() + 1;
+            route.method_name = kvp.first + "." + kvp2.first;
+            route.service = &service;
+            route.server = &server;
+            route.method = &kvp2.second;
+            _resolve_route(route);
+            route_ids_[route.method_name] = route.route_id;
+            routes_.push_back(route);
+        }
+    }
+}
+
+// Looks up the request and response types once so that calls need no lookups by name
+void RoutingSocket::_resolve_route(RouteInfo& route) {
+    auto& info3 = *route.method;
+    auto req_type = known_types_.find(info3.request_type);
+    auto res_type = known_types_.find(info3.response_type);
+    if (req_type == known_types_.end()) {
+        _add_error(info3.method_errors, boost::str(boost::format("Unknown method request type! %1%, %2%") %
+                                                   route.method_name % info3.request_type));
+        return;
+    }
+    if (res_type == known_types_.end()) {
+        _add_error(info3.method_errors, boost::str(boost::format("Unknown method response type! %1%, %2%") %
+                                                   route.method_name % info3.response_type));
+        return;
+    }
+
+    assert(req_type->second.class_id && req_type->second.local);
+    assert(res_type->second.class_id && res_type->second.local);
+    assert(req_type->second.class_id == req_type->second.instance_manager->_get_class_id());
+    assert(res_type->second.class_id == res_type->second.instance_manager->_get_class_id());
+
+    route.request_type = &req_type->second;
+    route.response_type = &res_type->second;
+    route.request_plan = find_type_plan(info3.request_type);
+    route.response_plan = find_type_plan(info3.response_type);
+    assert(route.request_plan && route.response_plan);
+}
+
+// Schema lock must be held exclusively, peers without route ids keep calling by name
+void RoutingSocket::_read_routes(nlohmann::json& schema, std::unordered_map<std::string, uint32_t>& routes) {
+    routes.clear();
+    for (auto& method_info : schema["methods"]) {
+        if (!method_info.contains("route_id") || (int)method_info["route_id"] <= 0) {
+            continue;
+        }
+        auto method_name = (std::string)method_info["service_name"] + "." + (std::string)method_info["method_name"];
+        routes[method_name] = (int)method_info["route_id"];
+    }
+}
+
+const RouteInfo* RoutingSocket::_find_route(std::span<const uint8_t> method_frame) {
+    auto route_id = get_route_id(method_frame);
+    if (!route_id) {
+        auto found = route_ids_.find(get_identity(method_frame));
+        if (found == route_ids_.end()) {
+            return nullptr;
+        }
+        route_id = found->second;
+    }
+    return route_id <= routes_.size() ? &routes_[route_id - 1] : nullptr;
+}
+
+// Reports why a call has no route, the schema lock must be held
+void RoutingSocket::_add_route_error(std::span<const uint8_t> method_frame) {
+    if (get_route_id(method_frame)) {
+        std::cerr << "Unknown route! " << get_method_label(method_frame) << std::endl;
+        return;
+    }
+
+    auto method_name = get_string(method_frame);
+    std::vector<std::string> parts;
+    boost::algorithm::split(parts, method_name, boost::is_any_of("."));
+
+    if (parts.size() != 2 || known_services_.find(parts[0]) == known_services_.end()) {
+        std::cerr << "Missing service! " << method_name << std::endl;
+        return;
+    }
+    auto& service_info = known_services_[parts[0]];
+    if (known_servers_.find(parts[0]) == known_servers_.end()) {
+        _add_error(service_info.service_errors, boost::str(boost::format("Missing server! %1%") % method_name));
+    } else if (service_info.methods.find(parts[1]) == service_info.methods.end()) {
+        _add_error(service_info.service_errors, boost::str(boost::format("Missing method! %1%") % method_name));
+    } else {
+        _add_error(service_info.service_errors,
+                   boost::str(boost::format("Missing server methods! %1%") % method_name));
+    }
+}
+
 void RoutingSocket::_get_app_info(nlohmann::json& request, std::vector<uint8_t>& response) {
     std::string this_socket;
     if (socket_type_ == BIND) {
@@ -400,7 +818,6 @@ void RoutingSocket::_get_app_info(nlohmann::json& request, std::vector<uint8_t>&
 
     nlohmann::json clients = nlohmann::json::array();
     if (socket_type_ == BIND) {
-        server_socket_->update();
         for (auto& item : server_socket_->get_client_full()) {
             ApplicationInfo::AppClientInfo client;
             client.client_id = item->client_id;
@@ -438,10 +855,11 @@ void RoutingSocket::_get_app_info(nlohmann::json& request, std::vector<uint8_t>&
     }));
 }
 
-void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& response, int active_client_id) {
+// Types, fields, services and methods in the GetSchema format, local_only leaves out what peers added
+nlohmann::json RoutingSocket::_get_declarations(bool local_only) {
     nlohmann::json types = nlohmann::json::array();
     for (auto kvp : known_types_) {
-        if (kvp.first == DYNAMIC_OBJECT) {
+        if (kvp.first == DYNAMIC_OBJECT || (local_only && !kvp.second.local)) {
             continue;
         }
         assert(kvp.second.type_name != "");
@@ -469,6 +887,9 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
             continue;
         }
         for (auto kvp2 : kvp.second.fields) {
+            if (local_only && !kvp2.second.local) {
+                continue;
+            }
             SchemaInfo::SchemaFieldInfo field;
             field.type_name = kvp.second.type_name;
             field.field_name = kvp2.second.field_name;
@@ -494,6 +915,9 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
 
     nlohmann::json services = nlohmann::json::array();
     for (auto kvp : known_services_) {
+        if (local_only && !kvp.second.local) {
+            continue;
+        }
         SchemaInfo::SchemaServiceInfo service;
         service.service_name = kvp.second.service_name;
         service.methods = kvp.second.methods.size();
@@ -513,12 +937,17 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
     nlohmann::json methods = nlohmann::json::array();
     for (auto& kvp : known_services_) {
         for (auto& kvp2 : kvp.second.methods) {
+            if (local_only && !kvp2.second.local) {
+                continue;
+            }
             SchemaInfo::SchemaMethodInfo method;
             method.service_name = kvp.second.service_name;
             method.method_name = kvp2.second.method_name;
             method.request_type = kvp2.second.request_type;
             method.response_type = kvp2.second.response_type;
             method.id_value = kvp2.second.id_value;
+            auto route = route_ids_.find(method.service_name + "." + method.method_name);
+            method.route_id = route != route_ids_.end() ? route->second : 0;
             method.local = kvp2.second.local;
             method.method_errors = kvp2.second.method_errors;
 
@@ -528,15 +957,126 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
                 {"request_type", method.request_type},
                 {"response_type", method.response_type},
                 {"id_value", method.id_value},
+                {"route_id", method.route_id},
                 {"local", method.local},
                 {"method_errors", method.method_errors},
             });
         }
     }
 
+    return nlohmann::json({
+        {"types", types},
+        {"fields", fields},
+        {"services", services},
+        {"methods", methods},
+    });
+}
+
+// Declaration keys compared by schema hashes and diffs, sizes, flags and errors are left out
+static nlohmann::json get_declaration_key(const nlohmann::json& item) {
+    nlohmann::json key = nlohmann::json::object();
+    for (auto name : {"type_name", "field_name", "field_type", "service_name", "method_name", "request_type",
+                      "response_type", "id_value"}) {
+        if (item.contains(name)) {
+            key[name] = item[name];
+        }
+    }
+    return key;
+}
+
+// Hash of the local declarations, equal hashes let connect skip the schema exchange
+std::string RoutingSocket::_get_schema_hash() {
+    auto declarations = _get_declarations(true);
+    nlohmann::json keys = nlohmann::json::object();
+    for (auto& kvp : declarations.items()) {
+        keys[kvp.key()] = nlohmann::json::array();
+        for (auto& item : kvp.value()) {
+            keys[kvp.key()].push_back(get_declaration_key(item));
+        }
+    }
+    return get_text_hash(keys.dump());
+}
+
+// Announced with AddClient and ClientAdded, see _sync_with_hash
+nlohmann::json RoutingSocket::_get_sync_metadata() {
+    nlohmann::json routes = nlohmann::json::object();
+    for (auto& kvp : route_ids_) {
+        routes[kvp.first] = kvp.second;
+    }
+    return nlohmann::json({
+        {"schema_hash", schema_hash_},
+        {"routes", routes},
+    });
+}
+
+// Declarations the peer lacks or declares differently, the peer's local declarations are in request.
+// The names of all declared services and methods are listed under "declared"
+void RoutingSocket::_get_schema_diff(nlohmann::json& request, std::vector<uint8_t>& response) {
+    auto declarations = _get_declarations(false);
+    std::set<std::string> peer_keys;
+    for (auto& kvp : declarations.items()) {
+        if (!request.contains(kvp.key())) {
+            continue;
+        }
+        for (auto& item : request[kvp.key()]) {
+            peer_keys.insert(get_declaration_key(item).dump());
+        }
+    }
+
+    auto is_known = [&peer_keys](nlohmann::json& item) {
+        return peer_keys.find(get_declaration_key(item).dump()) != peer_keys.end();
+    };
+
+    nlohmann::json diff = nlohmann::json::object();
+    std::set<std::string> types;
+    std::set<std::string> services;
+    diff["fields"] = nlohmann::json::array();
+    for (auto& item : declarations["fields"]) {
+        if (!is_known(item)) {
+            diff["fields"].push_back(item);
+            types.insert((std::string)item["type_name"]);
+        }
+    }
+    diff["methods"] = nlohmann::json::array();
+    for (auto& item : declarations["methods"]) {
+        if (!is_known(item)) {
+            diff["methods"].push_back(item);
+            services.insert((std::string)item["service_name"]);
+        }
+    }
+
+    // Fields and methods are only read for the types and services listed next to them
+    diff["types"] = nlohmann::json::array();
+    for (auto& item : declarations["types"]) {
+        if (!is_known(item) || types.count((std::string)item["type_name"])) {
+            diff["types"].push_back(item);
+        }
+    }
+    diff["services"] = nlohmann::json::array();
+    for (auto& item : declarations["services"]) {
+        if (!is_known(item) || services.count((std::string)item["service_name"])) {
+            diff["services"].push_back(item);
+        }
+    }
+
+    // Names of all services and methods declared here, the peer reports what it calls but
+    // can't find, see _find_missing_methods
+    diff["declared"] = {{"services", nlohmann::json::array()}, {"methods", nlohmann::json::array()}};
+    for (auto& item : declarations["services"]) {
+        diff["declared"]["services"].push_back({{"service_name", item["service_name"]}});
+    }
+    for (auto& item : declarations["methods"]) {
+        diff["declared"]["methods"].push_back(
+            {{"service_name", item["service_name"]}, {"method_name", item["method_name"]}});
+    }
+    response = get_buffer_json(diff);
+}
+
+void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& response, int active_client_id) {
+    auto declarations = _get_declarations(false);
+
     nlohmann::json clients = nlohmann::json::array();
     if (socket_type_ == BIND) {
-        server_socket_->update();
         for (auto& item : server_socket_->get_client_full()) {
             SchemaInfo::SchemaClientInfo client;
             client.main_port = port_;
@@ -595,10 +1135,10 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
     response = get_buffer_json(nlohmann::json({
         {"server_id", schema.server_id},
         {"client_id", schema.client_id},
-        {"types", types},
-        {"services", services},
-        {"fields", fields},
-        {"methods", methods},
+        {"types", declarations["types"]},
+        {"services", declarations["services"]},
+        {"fields", declarations["fields"]},
+        {"methods", declarations["methods"]},
         {"metadata", socket_type_ == BIND ? server_socket_->get_metadata() : client_socket_->get_metadata()},
         {"active_client", schema.active_client},
         {"this_socket", schema.this_socket},
@@ -608,9 +1148,17 @@ void RoutingSocket::_get_schema(nlohmann::json& request, std::vector<uint8_t>& r
     }));
 }
 
-void RoutingSocket::_set_schema(nlohmann::json& request, std::vector<uint8_t>& response) {
-    auto added1 = _find_new_fields(request, true);
-    auto added2 = _find_new_methods(request, true);
+void RoutingSocket::_set_schema(nlohmann::json& request, std::vector<uint8_t>& response, int client_id) {
+    _find_new_fields(request, true);
+    _find_new_methods(request, true);
+    auto client = server_socket_->get_client_info(client_id);
+    if (client) {
+        _read_routes(request, client->routes);
+    }
+    if (request.contains("schema_diff") && (bool)request["schema_diff"]) {
+        _get_schema_diff(request, response);
+        return;
+    }
     _get_schema(request, response, 0);
 }
 
@@ -619,12 +1167,48 @@ void RoutingSocket::_assign_values(std::string type_name, uint8_t* res_data, int
     assign_values(type_name, res_data, res_offset, res_size, data, target);
 }
 
+bool RoutingSocket::_assign_binary(std::string type_name, uint8_t* res_data, int res_offset, int res_size,
+                                   std::vector<uint8_t>& data, int target) {
+    return assign_binary(type_name, res_data, res_offset, res_size, data, target);
+}
+
 void RoutingSocket::_sync_with_server() {
     auto res = server_call(get_string(RoutingMessage::GetSchema), nlohmann::json({}));
 
+    // Reverse calls may already run on client workers, see _sync_with_hash
+    std::unique_lock<std::shared_mutex> lock(schema_lock_);
     _find_missing_methods(res);
-    auto added1 = _find_new_fields(res, true);
-    auto added2 = _find_new_methods(res, true);
+    _find_new_fields(res, true);
+    _find_new_methods(res, true);
+    _read_routes(res, server_routes_);
+}
+
+// Used with servers announcing a schema hash. Equal hashes skip the exchange, otherwise the local
+// declarations are sent and only what is missing here comes back. Route ids come with ClientAdded.
+void RoutingSocket::_sync_with_hash() {
+    auto server_metadata = client_socket_->get_server_metadata();
+    if ((std::string)server_metadata["schema_hash"] != schema_hash_) {
+        nlohmann::json request;
+        {
+            std::shared_lock<std::shared_mutex> lock(schema_lock_);
+            request = _get_declarations(true);
+        }
+        request["schema_diff"] = true;
+        auto res = server_call(get_string(RoutingMessage::SetSchema), request);
+
+        std::unique_lock<std::shared_mutex> lock(schema_lock_);
+        if (res.contains("declared")) {
+            _find_missing_methods(res["declared"]);
+        }
+        _find_new_fields(res, true);
+        _find_new_methods(res, true);
+    }
+
+    std::unique_lock<std::shared_mutex> lock(schema_lock_);
+    server_routes_.clear();
+    for (auto& item : server_metadata["routes"].items()) {
+        server_routes_[item.key()] = (int)item.value();
+    }
 }
 
 void RoutingSocket::_sync_with_client() {
@@ -834,18 +1418,36 @@ void RoutingSocket::wait() {
 }
 
 void RoutingSocket::close() {
-    is_alive_ = false;
+    // Called explicitly and again from the destructor
+    if (!processor_) {
+        is_alive_ = false;
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        is_alive_ = false;
+        pending_ready_.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(ready_lock_);
+        ready_changed_.notify_all();
+    }
     if (socket_type_ == SocketType::BIND) {
         server_socket_->set_closing();
     } else {
         client_socket_->set_closing();
     }
+    for (auto& worker : workers_) {
+        worker->join();
+    }
+    workers_.clear();
     processor_->join();
     if (socket_type_ == SocketType::BIND) {
         server_socket_->close();
     } else {
         client_socket_->close();
     }
+    server_socket_.reset();
     client_socket_.reset();
     processor_.reset();
 }
@@ -7,18 +7,42 @@
  *          connect
  *          cast
  *          server_thread
+ *          worker_thread
  *          client_thread
  *          client_call
+ *          client_call_async
+ *          broadcast_call
  *          forward_call
  *          server_call
+ *          server_call_async
+ *          co_server_call
+ *          co_client_call
+ *          _server_call
+ *          _server_call_async
+ *          _get_method_frame
+ *          _encode_typed
+ *          _decode_typed
  *          _incoming_call
+ *          _post_response
+ *          _add_error
  *          _add_types
  *          _add_server
+ *          _add_routes
+ *          _resolve_route
+ *          _read_routes
+ *          _find_route
+ *          _add_route_error
  *          _get_app_info
+ *          _get_declarations
+ *          _get_schema_hash
+ *          _get_sync_metadata
+ *          _get_schema_diff
  *          _get_schema
  *          _set_schema
  *          _assign_values
+ *          _assign_binary
  *          _sync_with_server
+ *          _sync_with_hash
  *          _sync_with_client
  *          _find_new_fields
  *          _find_new_methods
@@ -35,6 +59,12 @@
  */
 #pragma once
 #include "common_base.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <shared_mutex>
 #include <thread>
 
 namespace nrpc_cpp {
@@ -44,8 +74,9 @@ class ClientSocket;
 
 class RoutingSocket {
 public:
-    // See also: RoutingSocketOptions
-    RoutingSocket(nlohmann::json options);
+    // See also: RoutingSocketOptions. A zmq_context created by the caller is used as is and must
+    // outlive the socket, the context options are ignored then
+    RoutingSocket(nlohmann::json options, void* zmq_context = nullptr);
     ~RoutingSocket();
 
     void bind(std::string ip_address, int port);
@@ -58,36 +89,131 @@ public:
     }
 
     void server_thread();
+    void worker_thread();
     void client_thread();
+    // Throws CallError when the server is closed or the client is lost before it answers
     nlohmann::json client_call(int client_id, std::string method_name, nlohmann::json params);
+    std::future<nlohmann::json> client_call_async(int client_id, std::string method_name, nlohmann::json params);
+    // Callbacks get a CallError when the call ends without a response, futures throw it
+    void client_call_async(int client_id, std::string method_name, nlohmann::json params,
+                           std::function<void(nlohmann::json, std::exception_ptr)> callback);
+    CallAwaiter<nlohmann::json> co_client_call(int client_id, std::string method_name, nlohmann::json params);
+    // Responses by client id, clients that are lost, send malformed replies or don't answer within
+    // timeout_ms are left out. The timeout must be positive, see BROADCAST_TIMEOUT_MS
+    std::map<int, nlohmann::json> broadcast_call(std::string method_name, nlohmann::json params,
+                                                 std::function<bool(int)> client_filter = nullptr,
+                                                 int timeout_ms = BROADCAST_TIMEOUT_MS);
     nlohmann::json forward_call(int client_id, std::string method_name, nlohmann::json params);
+    // Throws CallError when the socket is closed or the server is lost before it answers, as client_call does
     nlohmann::json server_call(std::string method_name, nlohmann::json params);
-    
+    std::future<nlohmann::json> server_call_async(std::string method_name, nlohmann::json params);
+    void server_call_async(std::string method_name, nlohmann::json params,
+                           std::function<void(nlohmann::json, std::exception_ptr)> callback);
+    CallAwaiter<nlohmann::json> co_server_call(std::string method_name, nlohmann::json params);
+
     template<class RQ, class RS>
     RS server_call(std::string method_name, RQ request, std::shared_ptr<RS> response_) {
-        nlohmann::json req_data;
-        auto& req_type = known_types_[get_class_name<RQ>()];
-        auto& res_type = known_types_[get_class_name<RS>()];
-        assert(req_type.type_name != "");
-        assert(res_type.type_name != "");
-        assert(req_type.size == sizeof(RQ));
-        assert(res_type.size == sizeof(RS));
-        _assign_values(req_type.type_name, reinterpret_cast<uint8_t*>(&request), 0, sizeof(RQ), req_data, 1);
-        auto res_data = server_call(method_name, req_data);
+        std::vector<uint8_t> req_data;
+        _encode_typed(request, req_data);
+        auto res_data = _server_call(method_name, req_data);
         RS response;
-        _assign_values(res_type.type_name, reinterpret_cast<uint8_t*>(&response), 0, sizeof(RS), res_data, 0);
+        _decode_typed(res_data, response);
         return response;
     }
-    
-    void _incoming_call(std::string method_name, nlohmann::json req, std::vector<uint8_t>& response_data);
+
+    // Async calls complete on the I/O thread, callbacks must not wait for other calls on this socket
+    template<class RQ, class RS>
+    std::future<RS> server_call_async(std::string method_name, RQ request, std::shared_ptr<RS> response_) {
+        auto promise = std::make_shared<std::promise<RS>>();
+        auto result = promise->get_future();
+        server_call_async<RQ, RS>(method_name, request, [promise](RS response, std::exception_ptr error) {
+            if (error) {
+                promise->set_exception(error);
+            } else {
+                promise->set_value(std::move(response));
+            }
+        });
+        return result;
+    }
+
+    template<class RQ, class RS>
+    void server_call_async(std::string method_name, RQ request, std::function<void(RS, std::exception_ptr)> callback) {
+        std::vector<uint8_t> req_data;
+        _encode_typed(request, req_data);
+        _server_call_async(method_name, req_data, [this, method_name, callback](std::vector<uint8_t>& res_data) {
+            RS response;
+            if (!res_data.size()) {
+                callback(response, std::make_exception_ptr(CallError(method_name)));
+                return;
+            }
+            // Runs on the I/O thread, a malformed reply is reported to the callback and never thrown here
+            try {
+                _decode_typed(res_data, response);
+            } catch (...) {
+                callback(RS(), std::current_exception());
+                return;
+            }
+            callback(response, nullptr);
+        });
+    }
+
+    template<class RQ, class RS>
+    CallAwaiter<RS> co_server_call(std::string method_name, RQ request, std::shared_ptr<RS> response_) {
+        return CallAwaiter<RS>([this, method_name, request](std::function<void(RS, std::exception_ptr)> done) {
+            server_call_async<RQ, RS>(method_name, request, done);
+        });
+    }
+
+    template<class TP>
+    void _encode_typed(TP& value, std::vector<uint8_t>& data) {
+        assert(known_types_.find(get_class_name<TP>()) != known_types_.end());
+        if (format_type_ == FormatType::BINARY) {
+            assign_static_binary(value, data, 1);
+        } else {
+            nlohmann::json json;
+            assign_static(value, json, 1);
+            data = get_buffer_json(json);
+        }
+    }
+
+    template<class TP>
+    void _decode_typed(std::vector<uint8_t>& data, TP& value) {
+        assert(known_types_.find(get_class_name<TP>()) != known_types_.end());
+        if (is_binary_buffer(data)) {
+            assign_static_binary(value, data, 0);
+        } else {
+            auto json = get_json(data);
+            assign_static(value, json, 0);
+        }
+    }
+
+    std::vector<uint8_t> _server_call(std::string method_name, std::vector<uint8_t>& params);
+    void _server_call_async(std::string method_name, std::vector<uint8_t>& params,
+                            std::function<void(std::vector<uint8_t>&)> callback);
+    std::vector<uint8_t> _get_method_frame(const std::string& method_name, int client_id);
+    bool _incoming_call(std::span<const uint8_t> method_frame, std::span<const uint8_t> request_data,
+                        std::vector<uint8_t>& response_data, std::function<void(std::vector<uint8_t>&)> callback = nullptr);
+    void _post_response(int client_id, std::vector<std::vector<uint8_t>>& resp);
+    void _add_error(std::string& errors, std::string text);
     void _add_types(nlohmann::json types);
     void _add_server(nlohmann::json types);
+    void _add_routes();
+    void _resolve_route(RouteInfo& route);
+    void _read_routes(nlohmann::json& schema, std::unordered_map<std::string, uint32_t>& routes);
+    const RouteInfo* _find_route(std::span<const uint8_t> method_frame);
+    void _add_route_error(std::span<const uint8_t> method_frame);
     void _get_app_info(nlohmann::json& request, std::vector<uint8_t>& response);
+    nlohmann::json _get_declarations(bool local_only);
+    std::string _get_schema_hash();
+    nlohmann::json _get_sync_metadata();
+    void _get_schema_diff(nlohmann::json& request, std::vector<uint8_t>& response);
     void _get_schema(nlohmann::json& request, std::vector<uint8_t>& response, int active_client_id);
-    void _set_schema(nlohmann::json& request, std::vector<uint8_t>& response);
+    void _set_schema(nlohmann::json& request, std::vector<uint8_t>& response, int client_id);
 
     void _assign_values(std::string type_name, uint8_t* res_data, int res_offset, int res_size, nlohmann::json &data, int target);
+    bool _assign_binary(std::string type_name, uint8_t* res_data, int res_offset, int res_size, std::vector<uint8_t> &data, int target);
     void _sync_with_server();
+    void _sync_with_hash();
     void _sync_with_client();
     int _find_new_fields(nlohmann::json schema, bool do_add);
     int _find_new_methods(nlohmann::json schema, bool do_add);
@@ -108,18 +234,38 @@ private:
     ProtocolType protocol_type_{ProtocolType::TCP};
     FormatType format_type_{FormatType::JSON};
     std::string socket_name_;
+    bool multiplex_{false};
     std::string ip_address_;
+    void* zmq_context_{0};
+    bool owns_context_{false};
     int port_{0};
+    int worker_count_{0};
     bool is_alive_{false};
     std::shared_ptr<ServerSocket> server_socket_;
     std::shared_ptr<ClientSocket> client_socket_;
     std::shared_ptr<std::thread> processor_;
+    std::vector<std::shared_ptr<std::thread>> workers_;
+    std::deque<MessageInfo> pending_requests_;
+    std::mutex pending_lock_;
+    std::condition_variable pending_ready_;
+    std::shared_mutex schema_lock_;
+    std::mutex errors_lock_;
     std::map<std::string, ClassInfo> known_types_;
     std::map<std::string, ServiceInfo> known_services_;
     std::map<std::string, ServerInfo> known_servers_;
-    int call_count_{0};
+    // Dispatch table of the methods served here, built once by _add_routes. Peers learn the
+    // route ids from the schema, named calls are looked up in route_ids_
+    std::vector<RouteInfo> routes_;
+    std::unordered_map<std::string, uint32_t, IdentityHash, std::equal_to<>> route_ids_;
+    // Route ids of the server's methods, learned in _sync_with_server
+    std::unordered_map<std::string, uint32_t> server_routes_;
+    // Hash of the local declarations, see _get_schema_hash
+    std::string schema_hash_;
+    std::atomic<int> call_count_{0};
     bool do_sync_{false};
     bool is_ready_{false};
+    std::mutex ready_lock_;
+    std::condition_variable ready_changed_;
 };
 
 }  // namespace nrpc_cpp
\ No newline at end of file
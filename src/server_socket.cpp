@@ -7,26 +7,45 @@
  *          get_client_change
  *          recv_norm
  *          send_norm
+ *          post_norm
  *          send_rev
  *          recv_rev
  *          _add_client
+ *          _admit_clients
+ *          _validate_client
  *          _track_client
  *          _forward_call
  *          _recv_norm_step
+ *          _read_norm
+ *          _send_rev
  *          _recv_rev_step
+ *          _process_rev
+ *          _complete_rev
+ *          _complete_call
+ *          _fail_call
+ *          _fail_rev
+ *          _check_rev
+ *          _expire_calls
+ *          _get_poll_timeout
+ *          _flush_outbound
+ *          _wakeup
  *          get_client_ids
  *          get_client_full
  *          get_client_info
+ *          has_client
+ *          _find_client
+ *          _find_client_rev
+ *          _remove_client
+ *          _notify_change
  *          add_metadata
- *          get_request_lock
  *          get_metadata
  *          set_closing
- *          update
  *          wait
  *          close
  */
 #include "server_socket.hpp"
 
+#include <charconv>
 #include <zmq.h>
 #ifdef _WIN32
 #include <winsock2.h>
@@ -34,7 +53,7 @@
 
 namespace nrpc_cpp {
 
-ServerSocket::ServerSocket(std::string ip_address, int port, int port_rev, std::string socket_name) {
+ServerSocket::ServerSocket(std::string ip_address, int port, int port_rev, std::string socket_name, void* zmq_context) {
     server_id_ = 0;
     ip_address_ = ip_address;
     port_ = port;
@@ -76,13 +95,15 @@ ServerSocket::ServerSocket(std::string ip_address, int port, int port_rev, std::
 
     is_alive_ = true;
 
-    zmq_context_ = 0;
+    zmq_context_ = zmq_context;
     zmq_server_ = 0;
     zmq_server_rev_ = 0;
     zmq_monitor_ = 0;
+    zmq_wakeup_ = 0;
+    zmq_wakeup_send_ = 0;
     zmq_monitor_thread_.reset();
 
-    zmq_context_ = zmq_ctx_new();
+    assert(zmq_context_);
 
     zmq_server_ = zmq_socket(zmq_context_, ZMQ_ROUTER);
     auto rc = zmq_setsockopt(zmq_server_, ZMQ_IDENTITY, &server_signature_[0], server_signature_.size());
@@ -92,6 +113,24 @@ ServerSocket::ServerSocket(std::string ip_address, int port, int port_rev, std::
     rc = zmq_setsockopt(zmq_server_rev_, ZMQ_IDENTITY, &server_signature_rev_[0], server_signature_rev_.size());
     assert(rc == 0);
 
+    // Peers report connects and disconnects as [identity, empty] messages, see _track_client.
+    // Without draft support liveness falls back to peer state checks, see _check_rev
+    int notify = ZMQ_NOTIFY_DISCONNECT;
+    int notify_rev = ZMQ_NOTIFY_CONNECT | ZMQ_NOTIFY_DISCONNECT;
+    is_notified_ = zmq_setsockopt(zmq_server_, ZMQ_ROUTER_NOTIFY, &notify, sizeof(notify)) == 0 &&
+                   zmq_setsockopt(zmq_server_rev_, ZMQ_ROUTER_NOTIFY, &notify_rev, sizeof(notify_rev)) == 0;
+
+    // Wakes up the receiving thread when other threads queue outgoing messages, see post_norm
+    auto wakeup_addr = get_inproc_address("wakeup-server");
+    int linger = 0;
+    zmq_wakeup_ = zmq_socket(zmq_context_, ZMQ_PULL);
+    rc = zmq_bind(zmq_wakeup_, wakeup_addr.c_str());
+    assert(rc == 0);
+    zmq_wakeup_send_ = zmq_socket(zmq_context_, ZMQ_PUSH);
+    zmq_setsockopt(zmq_wakeup_send_, ZMQ_LINGER, &linger, sizeof(linger));
+    rc = zmq_connect(zmq_wakeup_send_, wakeup_addr.c_str());
+    assert(rc == 0);
+
     // self.zmq_monitor = zmq_server.get_monitor_socket(zmq.Event.ALL)
     // self.zmq_monitor_thread = threading.Thread(target=self._track_client)
     // self.zmq_monitor_thread.start()
@@ -102,13 +141,23 @@ void ServerSocket::bind() {
     auto addr_rev = boost::str(boost::format("tcp://%1%:%2%") % ip_address_ % port_rev_);
     auto rc = zmq_bind(zmq_server_, addr.c_str());
     assert(rc == 0);
+    if (!port_rev_) {
+        // Single channel, only multiplexed clients can connect
+        return;
+    }
     rc = zmq_bind(zmq_server_rev_, addr_rev.c_str());
     assert(rc == 0);
 }
 
+// Client set changes are signalled by _notify_change, the set is compared again after each one
 bool ServerSocket::get_client_change(int timeout_ms, std::vector<int>& expected_clients) {
-    auto started = std::chrono::steady_clock::now();
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
     while (is_alive_) {
+        uint64_t change_count = 0;
+        {
+            std::lock_guard<std::mutex> lock(change_lock_);
+            change_count = change_count_;
+        }
         auto client_ids = get_client_ids();
         if (!same_sets(client_ids, expected_clients)) {
             return true;
@@ -116,19 +165,20 @@ bool ServerSocket::get_client_change(int timeout_ms, std::vector<int>& expected_
         if (timeout_ms == 0) {
             break;
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(50));
-        auto elapsed_ms =
-            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
 
-        if (elapsed_ms > timeout_ms) {
+        std::unique_lock<std::mutex> lock(change_lock_);
+        auto changed = change_ready_.wait_until(lock, deadline, [this, change_count]() {
+            return !is_alive_ || change_count_ != change_count;
+        });
+        if (!changed) {
             break;
         }
     }
     return false;
 }
 
-bool ServerSocket::recv_norm(int& client_id, std::vector<std::vector<uint8_t>>& response) {
-    std::vector<std::vector<uint8_t>> req;
+bool ServerSocket::recv_norm(int& client_id, std::vector<MessageFrame>& response) {
+    std::vector<MessageFrame> req;
     response.resize(0);
     auto found = false;
     auto found_client_id = 0;
@@ -141,12 +191,13 @@ bool ServerSocket::recv_norm(int& client_id, std::vector<std::vector<uint8_t>>&
 
         if (req[1] == ServerMessage::AddClient) {
             _add_client(req);
-        } else if (req[1] == ServerMessage::ForwardCall) {
+        } else if (req[1] == ServerMessage::ForwardCall ||
+                   get_identity(req[1]).starts_with(get_identity(ServerMessage::ForwardTo))) {
             _forward_call(req);
         } else {
-            auto client = nrpc_cpp::find(clients_, [&req](auto x) { return x->client_signature == req[0]; });
+            auto client = _find_client(req[0]);
             if (!client) {
-                std::cerr << boost::str(boost::format("Dropping unknown client: %1%") % base64_encode(req[0]))
+                std::cerr << boost::str(boost::format("Dropping unknown client: %1%") % base64_encode(req[0].get_buffer()))
                           << std::endl;
                 continue;
             }
@@ -161,129 +212,184 @@ bool ServerSocket::recv_norm(int& client_id, std::vector<std::vector<uint8_t>>&
     }
 
     client_id = found_client_id;
-    response.resize(2);
-    response[0] = req[1];
-    response[1] = req[2];
+    response.resize(req.size() - 1);
+    response[0] = std::move(req[1]);
+    response[1] = std::move(req[2]);
+    if (req.size() == 4) {
+        response[2] = std::move(req[3]);
+    }
     return true;
 }
 
 void ServerSocket::send_norm(int client_id, std::vector<std::vector<uint8_t>>& response) {
-    zmq_msg_t msg;
-    auto client = nrpc_cpp::find(clients_, [client_id](auto x) { return x->client_id == client_id; });
-    assert(client);
-    assert(response.size() == 2);
+    assert(response.size() == 2 || response.size() == 3);
+    auto client = get_client_info(client_id);
+    if (!client) {
+        // Lost while the request was served
+        return;
+    }
     auto& part0 = client->client_signature;
     auto& part1 = response[0];
     auto& part2 = response[1];
+    auto has_call_id = response.size() == 3;
 
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
+    send_buffer_copy(zmq_server_, part0, ZMQ_SNDMORE);
+    send_buffer(zmq_server_, part1, ZMQ_SNDMORE);
+    send_buffer(zmq_server_, part2, has_call_id ? ZMQ_SNDMORE : 0);
 
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
+    if (has_call_id) {
+        auto& part3 = response[2];
+        send_buffer(zmq_server_, part3, 0);
+    }
+}
 
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_server_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+void ServerSocket::post_norm(int client_id, std::vector<std::vector<uint8_t>>& response) {
+    assert(response.size() == 2 || response.size() == 3);
+    std::lock_guard<std::mutex> lock(outbound_lock_);
+    outbound_norm_.push_back(MessageInfo());
+    outbound_norm_.back().client_id = client_id;
+    outbound_norm_.back().parts.swap(response);
+    _wakeup();
 }
 
-void ServerSocket::send_rev(int client_id, std::vector<std::vector<uint8_t>>& request) {
-    zmq_msg_t msg;
-    auto client = nrpc_cpp::find(clients_, [client_id](auto x) { return x->client_id == client_id; });
-    assert(client);
+uint32_t ServerSocket::send_rev(int client_id, std::vector<std::vector<uint8_t>>& request,
+                                std::function<void(std::vector<uint8_t>&)> callback) {
+    auto client = get_client_info(client_id);
+    auto is_lost = !client || client->is_lost;
     assert(request.size() == 2);
 
-    if (client->is_lost) {
-        // std::cerr << "Old client: " << client_id << std::endl;
-        return;
+    auto call = std::make_shared<PendingCallInfo>();
+    call->client_id = client_id;
+    call->callback = callback;
+    {
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        {
+            std::lock_guard<std::mutex> lock2(pending_lock_);
+            next_call_id_ += 1;
+            if (next_call_id_ == 0) {
+                next_call_id_ = 1;
+            }
+            call->call_id = next_call_id_;
+            pending_calls_[call->call_id] = call;
+        }
+        if (!is_lost) {
+            outbound_rev_.push_back(MessageInfo());
+            outbound_rev_.back().client_id = client_id;
+            outbound_rev_.back().parts.swap(request);
+            outbound_rev_.back().parts.push_back(get_buffer_call_id(call->call_id));
+            _wakeup();
+        }
     }
 
-    auto peer_state =
-        zmq_socket_get_peer_state(zmq_server_, &client->client_signature[0], client->client_signature.size()) + 1;
-    auto peer_state_rev =
-        zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0], client->client_signature_rev.size()) +
-        1;
-    if (peer_state == 0 || peer_state_rev == 0) {
-        client->is_lost = true;
-        // std::cerr << "Lost client: " << client_id << std::endl;
-        return;
+    if (is_lost) {
+        // std::cerr << "Old client: " << client_id << std::endl;
+        _fail_call(call->call_id);
     }
-
-    auto& part0 = client->client_signature_rev;
-    auto& part1 = request[0];
-    auto& part2 = request[1];
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_server_rev_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_server_rev_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
-
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_server_rev_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    return call->call_id;
 }
 
-bool ServerSocket::recv_rev(int client_id, std::vector<uint8_t>& response) {
-    std::vector<std::vector<uint8_t>> resp;
-    auto client = nrpc_cpp::find(clients_, [client_id](auto x) { return x->client_id == client_id; });
-    assert(client);
+bool ServerSocket::recv_rev(uint32_t call_id, std::vector<uint8_t>& response, int timeout_ms) {
     response.resize(0);
-
-    if (!(is_alive_ && !client->is_lost)) {
+    std::unique_lock<std::mutex> lock(pending_lock_);
+    auto found = pending_calls_.find(call_id);
+    if (found == pending_calls_.end()) {
         return false;
     }
-
-    while (is_alive_ && !client->is_lost) {
-        _recv_rev_step(client, resp);
-        if (!resp.size()) {
-            continue;
+    auto call = found->second;
+    assert(!call->callback);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    auto ready = [this, &call]() { return !is_alive_ || call->is_done; };
+    while (is_alive_ && !call->is_done) {
+        auto left_ms = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (timeout_ms > 0 && left_ms.count() <= 0) {
+            break;
+        }
+        if (std::this_thread::get_id() == receiver_id_.load()) {
+            // Nested call from a handler running on the receiving thread, serve the rev socket here
+            lock.unlock();
+            _flush_outbound();
+            _process_rev(timeout_ms > 0 ? std::clamp((int)left_ms.count(), 1, 100) : 100);
+            lock.lock();
+        } else if (timeout_ms > 0) {
+            call->ready.wait_until(lock, deadline, ready);
+        } else {
+            call->ready.wait(lock, ready);
         }
-        break;
     }
 
-    if (!(is_alive_ && !client->is_lost)) {
+    if (!call->is_done && is_alive_) {
+        // Timed out, the entry is kept so that _complete_rev drops the late response quietly.
+        // Clients that never answer don't keep it forever, see _expire_calls
+        call->is_cancelled = true;
+        call->expire_time = std::chrono::steady_clock::now() + std::chrono::milliseconds(CANCELLED_CALL_TTL_MS);
+        if (call->expire_time < expire_deadline_) {
+            expire_deadline_ = call->expire_time;
+            // The receiving thread may be blocked without a deadline, it picks up the new one
+            lock.unlock();
+            std::lock_guard<std::mutex> lock2(outbound_lock_);
+            _wakeup();
+        }
         return false;
     }
-
-    assert(resp.size());
-    response = resp[2];
+    pending_calls_.erase(call_id);
+    if (!call->response.size()) {
+        return false;
+    }
+    response.swap(call->response);
     return true;
 }
 
-void ServerSocket::_add_client(std::vector<std::vector<uint8_t>>& req) {
-    zmq_msg_t msg;
+void ServerSocket::_send_rev(int client_id, std::vector<std::vector<uint8_t>>& request) {
+    auto client = get_client_info(client_id);
+    assert(request.size() == 3);
+    if (!client || client->is_lost) {
+        // std::cerr << "Lost client: " << client_id << std::endl;
+        _fail_call(get_call_id(request[2]));
+        return;
+    }
+
+    auto socket = client->is_multiplexed ? zmq_server_ : zmq_server_rev_;
+    auto& part0 = client->client_signature_rev;
+    auto& part1 = request[0];
+    auto& part2 = request[1];
+    auto& part3 = request[2];
+    send_buffer_copy(socket, part0, ZMQ_SNDMORE);
+    if (client->is_multiplexed) {
+        send_buffer_copy(socket, ServerMessage::Reverse, ZMQ_SNDMORE);
+    }
+    send_buffer(socket, part1, ZMQ_SNDMORE);
+    send_buffer(socket, part2, ZMQ_SNDMORE);
+    send_buffer(socket, part3, 0);
+}
+
+void ServerSocket::_add_client(std::vector<MessageFrame>& req) {
     next_index_ += 1;
     auto client = std::make_shared<ClientInfo>();
     client->client_id = next_index_;
-    client->client_signature = req[0];
-    client->client_signature_rev = get_buffer(get_buffer("rev:"), client->client_signature);
+    client->client_signature = req[0].get_buffer();
     client->client_metadata = get_json(req[2]);
     client->connect_time = std::chrono::steady_clock::now();
     client->is_validated = false;
     client->is_lost = false;
-    clients_.push_back(client);
+    // Clients without a reverse port share the main connection in both directions
+    client->is_multiplexed =
+        client->client_metadata.contains("main_port_rev") && (int)client->client_metadata["main_port_rev"] == 0;
+    client->client_signature_rev = client->is_multiplexed
+                                       ? client->client_signature
+                                       : get_buffer(get_buffer("rev:"), client->client_signature);
+    // Route ids announced with AddClient, SetSchema replaces them when the schemas are exchanged
+    if (client->client_metadata.contains("routes")) {
+        for (auto& item : client->client_metadata["routes"].items()) {
+            client->routes[item.key()] = (int)item.value();
+        }
+    }
+    {
+        std::unique_lock<std::shared_mutex> lock(clients_lock_);
+        clients_[client->client_id] = client;
+        clients_by_signature_[std::string(get_identity(client->client_signature))] = client;
+        clients_by_signature_rev_[std::string(get_identity(client->client_signature_rev))] = client;
+    }
 
     auto resp = nlohmann::json({
         {"client_id", client->client_id},
@@ -297,126 +403,194 @@ void ServerSocket::_add_client(std::vector<std::vector<uint8_t>>& req) {
     auto part1 = ServerMessage::ClientAdded;
     auto part2 = get_buffer_json(resp);
 
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
+    send_buffer_copy(zmq_server_, part0, ZMQ_SNDMORE);
+    send_buffer(zmq_server_, part1, ZMQ_SNDMORE);
+    send_buffer_copy(zmq_server_, part2, 0);
 
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
+    if (client->is_multiplexed) {
+        // Nothing to validate, the client is reachable as soon as ClientAdded is sent
+        client->is_connected_rev = true;
+        client->is_validated = true;
+        _notify_change();
+        return;
+    }
 
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_server_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    // Reverse direction is validated from the receiving loop, see _admit_clients
+    client->validate_request.swap(part2);
+    admitting_.push_back(client);
+    _admit_clients();
+}
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+void ServerSocket::_admit_clients() {
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = admitting_.begin(); it != admitting_.end();) {
+        auto client = *it;
+        if (client->is_validated || client->is_lost) {
+            client->validate_request.clear();
+            it = admitting_.erase(it);
+            continue;
+        }
 
-    // TODO: check client_signature_rev peer status
+        auto elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - client->connect_time).count();
+        if (elapsed_ms > ADMISSION_TIMEOUT_MS) {
+            std::cerr << boost::str(boost::format("Client admission timed out: %1%") % client->client_id) << std::endl;
+            _remove_client(client);
+            it = admitting_.erase(it);
+            continue;
+        }
 
-    // Validate reverse direction
-    {
-        std::lock_guard<std::recursive_mutex> lock(request_lock_);
-        part0 = client->client_signature_rev;
-        part1 = ServerMessage::ValidateClient;
-        // part2 = part2;
-
-        auto rc = zmq_msg_init_size(&msg, part0.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-        rc = zmq_msg_send(&msg, zmq_server_rev_, ZMQ_SNDMORE);
-        assert(rc == part0.size());
-        zmq_msg_close(&msg);
-
-        rc = zmq_msg_init_size(&msg, part1.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-        rc = zmq_msg_send(&msg, zmq_server_rev_, ZMQ_SNDMORE);
-        assert(rc == part1.size());
-        zmq_msg_close(&msg);
-
-        rc = zmq_msg_init_size(&msg, part2.size());
-        assert(rc == 0);
-        memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-        rc = zmq_msg_send(&msg, zmq_server_rev_, 0);
-        assert(rc == part2.size());
-        zmq_msg_close(&msg);
-
-        rc = zmq_msg_init(&msg);
-        assert(rc == 0);
-        rc = zmq_msg_recv(&msg, zmq_server_rev_, 0);
-        assert(rc != -1);
-        assert(zmq_msg_more(&msg));
-        set_buffer(part0, zmq_msg_data(&msg), zmq_msg_size(&msg));
-        rc = zmq_msg_recv(&msg, zmq_server_rev_, 0);
-        assert(rc != -1);
-        assert(zmq_msg_more(&msg));
-        set_buffer(part1, zmq_msg_data(&msg), zmq_msg_size(&msg));
-        rc = zmq_msg_recv(&msg, zmq_server_rev_, 0);
-        assert(rc != -1);
-        assert(!zmq_msg_more(&msg));
-        set_buffer(part2, zmq_msg_data(&msg), zmq_msg_size(&msg));
-        zmq_msg_close(&msg);
-
-        assert(part0 == client->client_signature_rev);
-        assert(part1 == ServerMessage::ClientValidated);
-        auto resp3 = nrpc_cpp::get_json(part2);
-        assert((int)resp3["client_id"] == client->client_id);
-        assert(nrpc_cpp::base64_decode((std::string)resp3["client_signature"]) == client->client_signature);
+        // Reverse connection is made once the client has seen ClientAdded. With notifications the request
+        // is sent once after the connect is reported. Otherwise ROUTER may drop messages to peers that
+        // are not connected yet, so the request is repeated until the client answers
+        auto is_connected_rev = client->is_connected_rev;
+        if (!is_notified_) {
+            is_connected_rev = zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0],
+                                                         client->client_signature_rev.size()) != -1;
+        }
+        auto retry_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - client->validate_time).count();
+        auto is_retry = !is_notified_ && retry_ms > ADMISSION_RETRY_MS;
+        if (is_connected_rev && (!client->is_validating || is_retry)) {
+            auto& part0 = client->client_signature_rev;
+            auto part1 = ServerMessage::ValidateClient;
+            auto& part2 = client->validate_request;
+
+            send_buffer_copy(zmq_server_rev_, part0, ZMQ_SNDMORE);
+            send_buffer(zmq_server_rev_, part1, ZMQ_SNDMORE);
+            send_buffer_copy(zmq_server_rev_, part2, 0);
+            client->validate_time = now;
+            client->is_validating = true;
+        }
+        ++it;
+    }
+}
 
-        client->is_validated = true;
+void ServerSocket::_validate_client(std::vector<MessageFrame>& resp) {
+    auto client = _find_client_rev(resp[0]);
+    if (client && client->is_validated) {
+        // Answer to a repeated ValidateClient
+        return;
     }
+    if (!client) {
+        std::cerr << boost::str(boost::format("Dropping unknown client: %1%") % base64_encode(resp[0].get_buffer()))
+                  << std::endl;
+        return;
+    }
+
+    auto resp2 = nrpc_cpp::get_json(resp[2]);
+    assert((int)resp2["client_id"] == client->client_id);
+    assert(nrpc_cpp::base64_decode((std::string)resp2["client_signature"]) == client->client_signature);
+
+    client->is_validated = true;
+    _notify_change();
 }
 
-void ServerSocket::_track_client() {
-    assert(false);
+void ServerSocket::_track_client(std::vector<MessageFrame>& notice, bool is_rev) {
+    auto client = is_rev ? _find_client_rev(notice[0]) : _find_client(notice[0]);
+    if (!client) {
+        return;
+    }
+
+    // Norm socket only reports disconnects, the first notice on rev is the connect
+    if (is_rev && !client->is_connected_rev) {
+        client->is_connected_rev = true;
+        return;
+    }
+
+    // std::cerr << "Lost client: " << client->client_id << std::endl;
+    _remove_client(client);
+    _fail_rev(client->client_id);
 }
 
-bool ServerSocket::_recv_norm_step(std::vector<std::vector<uint8_t>>& request) {
-    auto ready = false;
-    auto ready_timeout = false;
+bool ServerSocket::_recv_norm_step(std::vector<MessageFrame>& request) {
+    request.resize(0);
+
+    receiver_id_.store(std::this_thread::get_id());
+
+    if (deferred_norm_.size()) {
+        request = std::move(deferred_norm_.front());
+        deferred_norm_.pop_front();
+        return true;
+    }
+
+    zmq_pollitem_t pollitems[3] = {0};
+    pollitems[0].socket = zmq_server_;
+    pollitems[0].events = ZMQ_POLLIN;
+    pollitems[1].socket = zmq_wakeup_;
+    pollitems[1].events = ZMQ_POLLIN;
+    pollitems[2].socket = zmq_server_rev_;
+    pollitems[2].events = ZMQ_POLLIN;
+    auto count = zmq_poll(pollitems, 3, _get_poll_timeout());
+
+    if (pollitems[1].revents & ZMQ_POLLIN) {
+        _flush_outbound();
+    }
+    if (pollitems[2].revents & ZMQ_POLLIN) {
+        _process_rev(0);
+    }
+    if (admitting_.size()) {
+        _admit_clients();
+    }
+    // Sockets are not thread-safe, peer states are checked here and never from caller threads
+    if (!is_notified_ && (count == 0 || std::chrono::steady_clock::now() >= next_check_time_)) {
+        next_check_time_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+        _check_rev();
+    }
+    _expire_calls();
+    if (!(pollitems[0].revents & ZMQ_POLLIN)) {
+        return false;
+    }
+    return _read_norm(request);
+}
+
+// Reads the main socket until a request arrives or nothing is left, disconnect notices and
+// responses of multiplexed clients are handled here
+bool ServerSocket::_read_norm(std::vector<MessageFrame>& request) {
     request.resize(0);
-    zmq_msg_t msg;
 
     while (is_alive_) {
-        auto timeout_ms = 100;
-        zmq_setsockopt(zmq_server_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
-        auto rc = zmq_msg_init(&msg);
-        assert(rc == 0);
-        rc = zmq_msg_recv(&msg, zmq_server_, 0);
-        if (rc == -1) {
-            ready_timeout = true;
+        norm_messages_.emplace_back();
+        if (!norm_messages_.back().recv(zmq_server_, ZMQ_DONTWAIT)) {
             assert(zmq_errno() == EAGAIN);
+            norm_messages_.pop_back();
+            return false;
         }
-        if (!is_alive_) {
-            zmq_msg_close(&msg);
-            break;
+
+        if (norm_messages_.back().more()) {
+            continue;
         }
-        timeout_ms = -1;
-        zmq_setsockopt(zmq_server_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
 
-        if (!is_alive_) {
-            zmq_msg_close(&msg);
-            break;
+        request.swap(norm_messages_);
+        norm_messages_.clear();
+        if (request.size() == 2 && !request[1].size()) {
+            _track_client(request, false);
+            request.resize(0);
+            continue;
         }
-        if (ready_timeout) {
-            zmq_msg_close(&msg);
+        if (request.size() >= 4 && request[1] == ServerMessage::Reverse) {
+            request.erase(request.begin() + 1);
+            _complete_rev(request);
+            request.resize(0);
+            continue;
+        }
+        assert(request.size() == 3 || request.size() == 4);
+        return true;
+    }
+    return false;
+}
+
+bool ServerSocket::_recv_rev_step(std::vector<MessageFrame>& response) {
+    auto ready = false;
+    response.resize(0);
+
+    while (is_alive_) {
+        rev_messages_.emplace_back();
+        if (!rev_messages_.back().recv(zmq_server_rev_, ZMQ_DONTWAIT)) {
+            assert(zmq_errno() == EAGAIN);
+            rev_messages_.pop_back();
             break;
         }
-                
-        norm_messages_.resize(norm_messages_.size() + 1);
-        set_buffer(norm_messages_.back(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-        auto ready_last = !zmq_msg_more(&msg);
-        zmq_msg_close(&msg);
-        if (ready_last) {
+
+        if (!rev_messages_.back().more()) {
             ready = true;
             break;
         }
@@ -426,179 +600,408 @@ bool ServerSocket::_recv_norm_step(std::vector<std::vector<uint8_t>>& request) {
         return false;
     }
 
-    request = norm_messages_;
-    norm_messages_.clear();
-    assert(request.size() == 3);
+    response.swap(rev_messages_);
+    rev_messages_.clear();
+    if (response.size() == 2 && !response[1].size()) {
+        _track_client(response, true);
+        response.resize(0);
+        return false;
+    }
+    assert(response.size() == 3 || response.size() == 4);
     return true;
 }
 
-bool ServerSocket::_recv_rev_step(std::shared_ptr<ClientInfo> client, std::vector<std::vector<uint8_t>>& response) {
-    auto ready = false;
-    auto ready_timeout = false;
-    response.resize(0);
-    zmq_msg_t msg;
-
-    while (is_alive_ && !client->is_lost) {
-        auto timeout_ms = 100;
-        zmq_setsockopt(zmq_server_rev_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
-        auto rc = zmq_msg_init(&msg);
-        assert(rc == 0);
-        rc = zmq_msg_recv(&msg, zmq_server_rev_, 0);
-        if (rc == -1) {
-            ready_timeout = true;
-            assert(zmq_errno() == EAGAIN);
+void ServerSocket::_process_rev(int timeout_ms) {
+    zmq_pollitem_t pollitems[2] = {0};
+    pollitems[0].socket = zmq_server_rev_;
+    pollitems[0].events = ZMQ_POLLIN;
+    pollitems[1].socket = zmq_server_;
+    pollitems[1].events = ZMQ_POLLIN;
+    if (timeout_ms > 0 && zmq_poll(pollitems, 2, timeout_ms) == 0) {
+        _check_rev();
+        return;
+    }
+
+    if (pollitems[1].revents & ZMQ_POLLIN) {
+        // Nested call, multiplexed clients answer on the main socket, requests wait for recv_norm
+        std::vector<MessageFrame> req;
+        while (_read_norm(req)) {
+            deferred_norm_.push_back(std::move(req));
         }
-        if (!(is_alive_ && !client->is_lost)) {
-            zmq_msg_close(&msg);
-            break;
+    }
+
+    std::vector<MessageFrame> resp;
+    while (_recv_rev_step(resp)) {
+        if (resp[1] == ServerMessage::ClientValidated) {
+            _validate_client(resp);
+            continue;
         }
-        timeout_ms = -1;
-        zmq_setsockopt(zmq_server_rev_, ZMQ_RCVTIMEO, &timeout_ms, sizeof(timeout_ms));
+        _complete_rev(resp);
+    }
+    _expire_calls();
+}
 
-        if (!(is_alive_ && !client->is_lost)) {
-            zmq_msg_close(&msg);
-            break;
+void ServerSocket::_complete_rev(std::vector<MessageFrame>& resp) {
+    auto client = _find_client_rev(resp[0]);
+    if (!client) {
+        std::cerr << boost::str(boost::format("Dropping unknown client: %1%") % base64_encode(resp[0].get_buffer()))
+                  << std::endl;
+        return;
+    }
+
+    // Responses without a call id come from clients that answer in order
+    auto call_id = resp.size() == 4 ? get_call_id(resp[3]) : 0;
+    std::shared_ptr<PendingCallInfo> call;
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        auto found = pending_calls_.end();
+        if (call_id) {
+            found = pending_calls_.find(call_id);
+        } else {
+            // The oldest call is answered first, cancelled ones included
+            auto client_id = client->client_id;
+            found = std::find_if(pending_calls_.begin(), pending_calls_.end(), [client_id](auto& x) {
+                return x.second->client_id == client_id && !x.second->is_done;
+            });
+        }
+        if (found == pending_calls_.end()) {
+            std::cerr << "Unexpected response dropped! " << get_method_label(resp[1]) << std::endl;
+            return;
+        }
+        call = found->second;
+        if (call->is_cancelled) {
+            // Late response to a call that timed out in recv_rev
+            pending_calls_.erase(found);
+            return;
+        }
+        if (call->callback) {
+            pending_calls_.erase(found);
+        }
+    }
+    // Responses outlive the frame, this is the only copy on the way to the caller
+    auto response = resp[2].get_buffer();
+    _complete_call(call, response);
+}
+
+void ServerSocket::_complete_call(std::shared_ptr<PendingCallInfo> call, std::vector<uint8_t>& response) {
+    if (call->callback) {
+        // Callbacks run on the I/O thread, one that throws must not end it
+        try {
+            call->callback(response);
+        } catch (const std::exception& e) {
+            std::cerr << "Call callback failed! " << e.what() << std::endl;
+        } catch (...) {
+            std::cerr << "Call callback failed!" << std::endl;
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(pending_lock_);
+    call->response.swap(response);
+    call->is_done = true;
+    call->ready.notify_all();
+}
+
+// Fails one call, e.g. a request that could not be sent, other calls to the client are left pending
+void ServerSocket::_fail_call(uint32_t call_id) {
+    std::shared_ptr<PendingCallInfo> call;
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        auto found = pending_calls_.find(call_id);
+        if (found == pending_calls_.end() || found->second->is_done) {
+            return;
+        }
+        if (found->second->is_cancelled) {
+            pending_calls_.erase(found);
+            return;
+        }
+        call = found->second;
+        if (call->callback) {
+            pending_calls_.erase(found);
+        }
+    }
+    std::vector<uint8_t> empty;
+    _complete_call(call, empty);
+}
+
+void ServerSocket::_fail_rev(int client_id) {
+    std::vector<std::shared_ptr<PendingCallInfo>> failed;
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        for (auto it = pending_calls_.begin(); it != pending_calls_.end();) {
+            auto call = it->second;
+            if ((client_id && call->client_id != client_id) || call->is_done) {
+                ++it;
+                continue;
+            }
+            if (call->is_cancelled) {
+                it = pending_calls_.erase(it);
+                continue;
+            }
+            failed.push_back(call);
+            it = call->callback ? pending_calls_.erase(it) : std::next(it);
         }
-        if (ready_timeout) {
-            zmq_msg_close(&msg);
+    }
+    for (auto& call : failed) {
+        std::vector<uint8_t> empty;
+        _complete_call(call, empty);
+    }
+}
+
+// Used when libzmq has no ROUTER_NOTIFY support, checks all peers for lost connections.
+// Only called from the receiving thread, which owns the sockets
+void ServerSocket::_check_rev() {
+    std::vector<std::shared_ptr<ClientInfo>> lost;
+    {
+        std::shared_lock<std::shared_mutex> lock(clients_lock_);
+        for (auto& item : clients_) {
+            auto& client = item.second;
+            if (!client->is_validated) continue;
             auto peer_state =
                 zmq_socket_get_peer_state(zmq_server_, &client->client_signature[0], client->client_signature.size()) + 1;
-            auto peer_state_rev =
-                zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0], client->client_signature_rev.size()) +
-                1;
-            if (peer_state == 0 || peer_state_rev == 0) {
-                client->is_lost = true;
-                // std::cerr << "Lost client: " << client_id << std::endl;
-                break;
+            auto peer_state_rev = client->is_multiplexed
+                                      ? peer_state
+                                      : zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0],
+                                                                  client->client_signature_rev.size()) +
+                                            1;
+            if (client->is_lost || peer_state == 0 || peer_state_rev == 0) {
+                lost.push_back(client);
             }
-            break;
         }
+    }
+    for (auto& client : lost) {
+        _remove_client(client);
+        _fail_rev(client->client_id);
+    }
+}
 
-        rev_messages_.resize(rev_messages_.size() + 1);
-        set_buffer(rev_messages_.back(), zmq_msg_data(&msg), zmq_msg_size(&msg));
-        auto ready_last = !zmq_msg_more(&msg);
-        zmq_msg_close(&msg);
-        if (ready_last) {
-            ready = true;
-            break;
+// Drops timed-out calls whose late response didn't arrive in time, the scan runs once the earliest is due
+void ServerSocket::_expire_calls() {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(pending_lock_);
+    if (now < expire_deadline_) {
+        return;
+    }
+
+    expire_deadline_ = std::chrono::steady_clock::time_point::max();
+    for (auto it = pending_calls_.begin(); it != pending_calls_.end();) {
+        auto& call = it->second;
+        if (!call->is_cancelled) {
+            ++it;
+        } else if (call->expire_time <= now) {
+            it = pending_calls_.erase(it);
+        } else {
+            expire_deadline_ = std::min(expire_deadline_, call->expire_time);
+            ++it;
         }
     }
+}
 
-    if (!ready) {
-        return false;
+// Poll waits until the nearest admission or expiry deadline, or indefinitely when nothing is due.
+// Without notifications admissions and lost peers are only seen by polling peer states, see _check_rev
+int ServerSocket::_get_poll_timeout() {
+    if (!is_notified_) {
+        return admitting_.size() ? ADMISSION_RETRY_MS : 100;
     }
 
-    response = rev_messages_;
-    rev_messages_.clear();
-    assert(response.size() == 3);
-    assert(response[0] == client->client_signature_rev);
-    return true;
+    auto deadline = std::chrono::steady_clock::time_point::max();
+    for (auto& client : admitting_) {
+        deadline = std::min(deadline, client->connect_time + std::chrono::milliseconds(ADMISSION_TIMEOUT_MS));
+    }
+    {
+        std::lock_guard<std::mutex> lock(pending_lock_);
+        deadline = std::min(deadline, expire_deadline_);
+    }
+    if (deadline == std::chrono::steady_clock::time_point::max()) {
+        return -1;
+    }
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+    return std::max(0, (int)left.count() + 1);
 }
 
-void ServerSocket::_forward_call(std::vector<std::vector<uint8_t>>& req) {
-    auto req2 = nrpc_cpp::get_json(req[2]);
-    assert(req2.contains("client_id"));
-    auto client_id = (int)req2["client_id"];
-    auto method_name = (std::string)req2["method_name"];
-    auto method_params = (nlohmann::json)req2["method_params"];
-    auto client1 = nrpc_cpp::find(clients_, [&req, client_id](auto x) { return x->client_signature == req[0]; });
-    auto client2 = nrpc_cpp::find(clients_, [&req, client_id](auto x) { return x->client_id == client_id; });
-    assert(client1);
-    assert(client2);
-
-    std::vector<uint8_t> res;
+void ServerSocket::_flush_outbound() {
+    std::deque<MessageInfo> outbound;
+    std::deque<MessageInfo> outbound_rev;
     {
-        std::lock_guard<std::recursive_mutex> lock(request_lock_);
-        std::vector<std::vector<uint8_t>> req3;
-        req3.resize(2);
-        req3[0] = nrpc_cpp::get_buffer(method_name);
-        req3[1] = nrpc_cpp::get_buffer_json(method_params);
-        send_rev(client_id, req3);
-        recv_rev(client_id, res);
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        uint8_t signal[16];
+        while (zmq_recv(zmq_wakeup_, signal, sizeof(signal), ZMQ_DONTWAIT) != -1) {
+        }
+        outbound.swap(outbound_norm_);
+        outbound_rev.swap(outbound_rev_);
     }
 
-    auto part0 = client1->client_signature;
-    auto part1 = get_buffer(get_buffer("fwd_response:"), get_buffer(method_name));
-    auto part2 = res;
+    for (auto& item : outbound) {
+        if (!get_client_info(item.client_id)) {
+            continue;
+        }
+        send_norm(item.client_id, item.parts);
+    }
+    for (auto& item : outbound_rev) {
+        _send_rev(item.client_id, item.parts);
+    }
+}
 
-    zmq_msg_t msg;
-    auto rc = zmq_msg_init_size(&msg, part0.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part0[0], part0.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part0.size());
-    zmq_msg_close(&msg);
+void ServerSocket::_forward_call(std::vector<MessageFrame>& req) {
+    auto client1 = _find_client(req[0]);
+    if (!client1) {
+        std::cerr << boost::str(boost::format("Dropping unknown client: %1%") % base64_encode(req[0].get_buffer()))
+                  << std::endl;
+        return;
+    }
 
-    rc = zmq_msg_init_size(&msg, part1.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part1[0], part1.size());
-    rc = zmq_msg_send(&msg, zmq_server_, ZMQ_SNDMORE);
-    assert(rc == part1.size());
-    zmq_msg_close(&msg);
+    int client_id = 0;
+    bool is_valid = true;
+    std::string method_name;
+    std::vector<std::vector<uint8_t>> req3;
+    req3.resize(2);
+    if (req[1] == ServerMessage::ForwardCall) {
+        // Older peers wrap the call in JSON
+        auto req2 = nrpc_cpp::get_json(req[2]);
+        assert(req2.contains("client_id"));
+        client_id = (int)req2["client_id"];
+        method_name = (std::string)req2["method_name"];
+        req3[1] = nrpc_cpp::get_buffer_json((nlohmann::json)req2["method_params"]);
+    } else {
+        // Route is read from the method frame, the payload frame goes to the target client unparsed
+        auto route = get_identity(req[1]).substr(ServerMessage::ForwardTo.size());
+        auto separator = route.find(':');
+        if (separator == std::string_view::npos ||
+            std::from_chars(route.data(), route.data() + separator, client_id).ec != std::errc()) {
+            std::cerr << boost::str(boost::format("Malformed forward call: %1%") % route) << std::endl;
+            is_valid = false;
+        }
+        method_name = std::string(route.substr(separator == std::string_view::npos ? route.size() : separator + 1));
+        req3[1] = req[2].get_buffer();
+    }
+    req3[0] = nrpc_cpp::get_buffer(method_name);
 
-    rc = zmq_msg_init_size(&msg, part2.size());
-    assert(rc == 0);
-    memcpy(zmq_msg_data(&msg), &part2[0], part2.size());
-    rc = zmq_msg_send(&msg, zmq_server_, 0);
-    assert(rc == part2.size());
-    zmq_msg_close(&msg);
+    // The response is relayed from the receiving thread once the target client answers
+    std::vector<std::vector<uint8_t>> resp;
+    resp.resize(2);
+    resp[0] = get_buffer(get_buffer("fwd_response:"), get_buffer(method_name));
+    if (req.size() == 4) {
+        resp.push_back(req[3].get_buffer());
+    }
+
+    // No target to call, the source gets the empty reply right away
+    auto source_id = client1->client_id;
+    if (!is_valid || client_id <= 0) {
+        resp[1] = get_buffer_json(nlohmann::json::object());
+        send_norm(source_id, resp);
+        return;
+    }
+
+    send_rev(client_id, req3, [this, source_id, resp](std::vector<uint8_t>& res) mutable {
+        if (res.size()) {
+            resp[1].swap(res);
+        } else {
+            resp[1] = get_buffer_json(nlohmann::json::object());
+        }
+        if (get_client_info(source_id)) {
+            send_norm(source_id, resp);
+        }
+    });
 }
 
+// Wakeup message is only a signal, a full queue means the receiver is already awake.
+// The PUSH socket is shared by caller threads, outbound_lock_ must be held.
+void ServerSocket::_wakeup() {
+    if (!zmq_wakeup_send_) {
+        return;
+    }
+    uint8_t signal = 0;
+    zmq_send(zmq_wakeup_send_, &signal, 1, ZMQ_DONTWAIT);
+}
+
+// Lost clients are removed as soon as a disconnect is reported, see _track_client. Without
+// notifications the receiving thread checks peer states, callers only read the registry
 std::vector<int> ServerSocket::get_client_ids() {
     std::vector<int> result;
-    for (auto client : clients_) {
-        if (client->is_lost) continue;
-        if (client->client_signature_rev.empty()) continue;
-        if (!client->is_validated) continue;
-        auto peer_state =
-            zmq_socket_get_peer_state(zmq_server_, &client->client_signature[0], client->client_signature.size()) + 1;
-        auto peer_state_rev = zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0],
-                                                        client->client_signature_rev.size()) +
-                              1;
-        if (peer_state == 0 || peer_state_rev == 0) {
-            client->is_lost = true;
-            // std::cerr << "Lost client: " << client->client_id << std::endl;
-            continue;
+    {
+        std::shared_lock<std::shared_mutex> lock(clients_lock_);
+        for (auto& item : clients_) {
+            auto& client = item.second;
+            if (client->is_lost) continue;
+            if (client->client_signature_rev.empty()) continue;
+            if (!client->is_validated) continue;
+            result.push_back(client->client_id);
         }
-        result.push_back(client->client_id);
     }
+    std::sort(result.begin(), result.end());
     return result;
 }
 
-std::vector<std::shared_ptr<ClientInfo>> ServerSocket::get_client_full() { return clients_; }
+std::vector<std::shared_ptr<ClientInfo>> ServerSocket::get_client_full() {
+    std::vector<std::shared_ptr<ClientInfo>> result;
+    {
+        std::shared_lock<std::shared_mutex> lock(clients_lock_);
+        for (auto& item : clients_) {
+            result.push_back(item.second);
+        }
+    }
+    std::sort(result.begin(), result.end(), [](auto& x, auto& y) { return x->client_id < y->client_id; });
+    return result;
+}
 
 std::shared_ptr<ClientInfo> ServerSocket::get_client_info(int client_id) {
-    return find(
-        clients_,
-        [client_id](auto x){
-            return x->client_id == client_id;
-        }
-    );
+    std::shared_lock<std::shared_mutex> lock(clients_lock_);
+    auto found = clients_.find(client_id);
+    return found != clients_.end() ? found->second : nullptr;
+}
+
+bool ServerSocket::has_client(int client_id) {
+    auto client = get_client_info(client_id);
+    return client && client->is_validated && !client->is_lost;
+}
+
+std::shared_ptr<ClientInfo> ServerSocket::_find_client(std::span<const uint8_t> client_signature) {
+    std::shared_lock<std::shared_mutex> lock(clients_lock_);
+    auto found = clients_by_signature_.find(get_identity(client_signature));
+    return found != clients_by_signature_.end() ? found->second : nullptr;
 }
 
-void ServerSocket::add_metadata(nlohmann::json data) { assert(false); }
+std::shared_ptr<ClientInfo> ServerSocket::_find_client_rev(std::span<const uint8_t> client_signature_rev) {
+    std::shared_lock<std::shared_mutex> lock(clients_lock_);
+    auto found = clients_by_signature_rev_.find(get_identity(client_signature_rev));
+    return found != clients_by_signature_rev_.end() ? found->second : nullptr;
+}
+
+// Lost clients leave the registry, holders of the ClientInfo see is_lost
+void ServerSocket::_remove_client(std::shared_ptr<ClientInfo> client) {
+    client->is_lost = true;
+    std::unique_lock<std::shared_mutex> lock(clients_lock_);
+    clients_.erase(client->client_id);
+    clients_by_signature_.erase(std::string(get_identity(client->client_signature)));
+    clients_by_signature_rev_.erase(std::string(get_identity(client->client_signature_rev)));
+    lock.unlock();
+    _notify_change();
+}
+
+void ServerSocket::_notify_change() {
+    std::lock_guard<std::mutex> lock(change_lock_);
+    change_count_ += 1;
+    change_ready_.notify_all();
+}
 
-std::recursive_mutex& ServerSocket::get_request_lock() { return request_lock_; }
+// Extra entries sent with ClientAdded, must be added before bind
+void ServerSocket::add_metadata(nlohmann::json data) {
+    for (auto& item : data.items()) {
+        metadata_[item.key()] = item.value();
+    }
+}
 
 nlohmann::json ServerSocket::get_metadata() { return metadata_; }
 
 void ServerSocket::set_closing() {
     is_alive_ = false;
-}
-
-void ServerSocket::update() {
-    assert(this);
-    for (auto client : clients_) {
-        if (client->is_lost) continue;
-        auto peer_state =
-            zmq_socket_get_peer_state(zmq_server_, &client->client_signature[0], client->client_signature.size()) + 1;
-        auto peer_state_rev = zmq_socket_get_peer_state(zmq_server_rev_, &client->client_signature_rev[0],
-                                                        client->client_signature_rev.size()) +
-                              1;
-        if (peer_state == 0 || peer_state_rev == 0) {
-            client->is_lost = true;
-            // std::cerr << "Lost client: " << client->client_id << std::endl;
-        }
+    _notify_change();
+    {
+        std::lock_guard<std::mutex> lock(outbound_lock_);
+        _wakeup();
+    }
+    std::lock_guard<std::mutex> lock(pending_lock_);
+    for (auto& item : pending_calls_) {
+        item.second->ready.notify_all();
     }
 }
 
@@ -633,8 +1036,7 @@ void ServerSocket::wait() {
 }
 
 void ServerSocket::close() {
-    auto zmq_context = zmq_context_;
-    std::vector<void*> servers = {zmq_server_, zmq_server_rev_, zmq_monitor_};
+    std::vector<void*> servers = {zmq_server_, zmq_server_rev_, zmq_monitor_, zmq_wakeup_, zmq_wakeup_send_};
 
     is_alive_ = false;
 
@@ -642,22 +1044,30 @@ void ServerSocket::close() {
         zmq_monitor_thread_->join();
     }
 
+    _fail_rev(0);
+
     auto rc = zmq_socket_monitor(zmq_server_, 0, 0);
     assert(rc == 0);
 
     zmq_server_ = 0;
     zmq_server_rev_ = 0;
     zmq_monitor_ = 0;
+    zmq_wakeup_ = 0;
+    zmq_wakeup_send_ = 0;
     zmq_monitor_thread_.reset();
     zmq_context_ = 0;
 
-    for (int j = 0; j < 3; j++) {
+    // Replies queued just before close are still sent, the context may be shared with other sockets
+    int linger = CLOSE_LINGER_MS;
+    zmq_setsockopt(servers[0], ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(servers[1], ZMQ_LINGER, &linger, sizeof(linger));
+
+    // The context is owned by RoutingSocket
+    for (int j = 0; j < servers.size(); j++) {
         if (servers[j]) {
             zmq_close(servers[j]);
         }
     }
-
-    zmq_close(zmq_context);
 }
 
 }  // namespace nrpc_cpp
\ No newline at end of file
@@ -7,53 +7,96 @@
  *          get_client_change
  *          recv_norm
  *          send_norm
+ *          post_norm
  *          send_rev
  *          recv_rev
  *          _add_client
+ *          _admit_clients
+ *          _validate_client
  *          _track_client
  *          _recv_norm_step
+ *          _read_norm
+ *          _send_rev
  *          _recv_rev_step
+ *          _process_rev
+ *          _complete_rev
+ *          _complete_call
+ *          _fail_call
+ *          _fail_rev
+ *          _check_rev
+ *          _expire_calls
+ *          _get_poll_timeout
+ *          _flush_outbound
+ *          _wakeup
  *          _forward_call
  *          get_client_ids
  *          get_client_full
  *          get_client_info
+ *          has_client
+ *          _find_client
+ *          _find_client_rev
+ *          _remove_client
+ *          _notify_change
  *          add_metadata
- *          get_request_lock
  *          get_metadata
  *          set_closing
- *          update
  *          wait
  *          close
  */
 #pragma once
 #include "common_base.hpp"
+#include <atomic>
+#include <deque>
 #include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
 
 namespace nrpc_cpp {
 
 class ServerSocket {
 public:
-    ServerSocket(std::string ip_address, int port, int port_rev, std::string socket_name);
+    ServerSocket(std::string ip_address, int port, int port_rev, std::string socket_name, void* zmq_context);
     void bind();
     bool get_client_change(int timeout_ms, std::vector<int>& expected_clients);
 
-    bool recv_norm(int& client_id, std::vector<std::vector<uint8_t>>& response);
+    bool recv_norm(int& client_id, std::vector<MessageFrame>& response);
+    // Payload parts are handed to libzmq without a copy and left empty, see send_buffer
     void send_norm(int client_id, std::vector<std::vector<uint8_t>>& request);
-    void send_rev(int client_id, std::vector<std::vector<uint8_t>>& request);
-    bool recv_rev(int client_id, std::vector<uint8_t>& response);
-    void _add_client(std::vector<std::vector<uint8_t>>& req);
-    void _track_client();
-    bool _recv_norm_step(std::vector<std::vector<uint8_t>>& request);
-    bool _recv_rev_step(std::shared_ptr<ClientInfo> client, std::vector<std::vector<uint8_t>>& response);
-    void _forward_call(std::vector<std::vector<uint8_t>>& req);
+    void post_norm(int client_id, std::vector<std::vector<uint8_t>>& response);
+    uint32_t send_rev(int client_id, std::vector<std::vector<uint8_t>>& request,
+                      std::function<void(std::vector<uint8_t>&)> callback = nullptr);
+    // A timeout_ms of 0 waits until the call completes or the client is lost
+    bool recv_rev(uint32_t call_id, std::vector<uint8_t>& response, int timeout_ms = 0);
+    void _add_client(std::vector<MessageFrame>& req);
+    void _admit_clients();
+    void _validate_client(std::vector<MessageFrame>& resp);
+    void _track_client(std::vector<MessageFrame>& notice, bool is_rev);
+    bool _recv_norm_step(std::vector<MessageFrame>& request);
+    bool _read_norm(std::vector<MessageFrame>& request);
+    void _send_rev(int client_id, std::vector<std::vector<uint8_t>>& request);
+    bool _recv_rev_step(std::vector<MessageFrame>& response);
+    void _process_rev(int timeout_ms);
+    void _complete_rev(std::vector<MessageFrame>& resp);
+    void _complete_call(std::shared_ptr<PendingCallInfo> call, std::vector<uint8_t>& response);
+    void _fail_call(uint32_t call_id);
+    void _fail_rev(int client_id);
+    void _check_rev();
+    void _expire_calls();
+    int _get_poll_timeout();
+    void _flush_outbound();
+    void _wakeup();
+    void _forward_call(std::vector<MessageFrame>& req);
     std::vector<int> get_client_ids();
     std::vector<std::shared_ptr<ClientInfo>> get_client_full();
     std::shared_ptr<ClientInfo> get_client_info(int client_id);
+    bool has_client(int client_id);
+    std::shared_ptr<ClientInfo> _find_client(std::span<const uint8_t> client_signature);
+    std::shared_ptr<ClientInfo> _find_client_rev(std::span<const uint8_t> client_signature_rev);
+    void _remove_client(std::shared_ptr<ClientInfo> client);
+    void _notify_change();
     void add_metadata(nlohmann::json data);
-    std::recursive_mutex& get_request_lock();
     nlohmann::json get_metadata();
     void set_closing();
-    void update();
     void wait();
     void close();
 
@@ -66,17 +109,40 @@ private:
     int next_index_{0};
     std::vector<uint8_t> server_signature_;
     std::vector<uint8_t> server_signature_rev_;
-    std::vector<std::shared_ptr<ClientInfo>> clients_;
+    // Indexed by client_id and by routing identity on the norm and rev sockets, lost clients are removed
+    std::shared_mutex clients_lock_;
+    std::unordered_map<int, std::shared_ptr<ClientInfo>> clients_;
+    std::unordered_map<std::string, std::shared_ptr<ClientInfo>, IdentityHash, std::equal_to<>> clients_by_signature_;
+    std::unordered_map<std::string, std::shared_ptr<ClientInfo>, IdentityHash, std::equal_to<>> clients_by_signature_rev_;
+    std::vector<std::shared_ptr<ClientInfo>> admitting_;
     nlohmann::json metadata_;
     void* zmq_context_{0};
     void* zmq_server_{0};
     void* zmq_server_rev_{0};
     void* zmq_monitor_{0};
+    void* zmq_wakeup_{0};
+    void* zmq_wakeup_send_{0};
     std::shared_ptr<std::thread> zmq_monitor_thread_;
-    std::recursive_mutex request_lock_;
+    std::mutex outbound_lock_;
+    std::deque<MessageInfo> outbound_norm_;
+    std::deque<MessageInfo> outbound_rev_;
+    std::mutex pending_lock_;
+    std::map<uint32_t, std::shared_ptr<PendingCallInfo>> pending_calls_;
+    uint32_t next_call_id_{0};
+    // Earliest expire_time of the cancelled calls, guarded by pending_lock_
+    std::chrono::steady_clock::time_point expire_deadline_{std::chrono::steady_clock::time_point::max()};
+    std::chrono::steady_clock::time_point next_check_time_;
+    // Written by the receiving thread, read by recv_rev callers on any thread
+    std::atomic<std::thread::id> receiver_id_;
     bool is_alive_{false};
-    std::vector<std::vector<uint8_t>> norm_messages_;
-    std::vector<std::vector<uint8_t>> rev_messages_;
+    bool is_notified_{false};
+    std::mutex change_lock_;
+    std::condition_variable change_ready_;
+    uint64_t change_count_{0};
+    std::vector<MessageFrame> norm_messages_;
+    // Requests read from the main socket while a nested call waits for a multiplexed client, see _process_rev
+    std::deque<std::vector<MessageFrame>> deferred_norm_;
+    std::vector<MessageFrame> rev_messages_;
 };
 
 }  // namespace nrpc_cpp
\ No newline at end of file
@@ -0,0 +1,150 @@
+/**
+ * Contents:
+ *
+ *      HelloRequest
+ *      HelloResponse
+ *      HelloService
+ *      BenchApplication
+ *          bind
+ *          main_loop
+ *          Hello
+ */
+#include "../src/nrpc_cpp.hpp"
+
+$rpcclass(HelloRequest, $field(name, 1), $field(value, 2));
+class HelloRequest {
+public:
+    std::string name;
+    int value{0};
+};
+
+$rpcclass(HelloResponse, $field(summary, 1), $field(echo, 2));
+class HelloResponse {
+public:
+    std::string summary;
+    HelloRequest echo;
+};
+
+$rpcclass(HelloService, $method(Hello, 1));
+class HelloService {
+public:
+    HelloResponse Hello(HelloRequest request) { return HelloResponse(); }
+};
+
+/** Measures the time from creating a client socket to the response of its first call */
+class BenchApplication {
+public:
+    BenchApplication() {
+        cmd_ = nrpc_cpp::CommandLine({
+            {"port", 9005},
+            {"format", "json"},
+            {"count", 20},
+            {"sync", true},
+            {"multiplex", false},
+        });
+    }
+
+    void bind() {
+        std::cout << "Started server: " << (int)cmd_["port"] << std::endl;
+
+        // clang-format off
+        sock_ = std::make_shared<nrpc_cpp::RoutingSocket>(nrpc_cpp::RoutingSocketOptions({
+            {"type", nrpc_cpp::SocketType::BIND},
+            {"protocol", nrpc_cpp::ProtocolType::TCP},
+            {"format", (std::string)cmd_["format"] == "json" ? nrpc_cpp::FormatType::JSON : nrpc_cpp::FormatType::BINARY},
+            {"name", "bench_connect_cpp"},
+            {"multiplex", (bool)cmd_["multiplex"]},
+            {
+                "types",
+                {
+                    nrpc_cpp::type<HelloRequest>(),
+                    nrpc_cpp::type<HelloResponse>(),
+                    nrpc_cpp::service<HelloService>(),
+                    nrpc_cpp::service<HelloService>("BenchApplication", this)
+                }
+            }
+        }));
+        // clang-format on
+
+        sock_->bind("127.0.0.1", (int)cmd_["port"]);
+    }
+
+    void main_loop() {
+        std::vector<double> connect_ms;
+        std::vector<double> first_call_ms;
+
+        for (int j = 0; j < (int)cmd_["count"]; j++) {
+            auto started = std::chrono::steady_clock::now();
+
+            // clang-format off
+            auto client = std::make_shared<nrpc_cpp::RoutingSocket>(nrpc_cpp::RoutingSocketOptions({
+                {"type", nrpc_cpp::SocketType::CONNECT},
+                {"protocol", nrpc_cpp::ProtocolType::TCP},
+                {"format", (std::string)cmd_["format"] == "json" ? nrpc_cpp::FormatType::JSON : nrpc_cpp::FormatType::BINARY},
+                {"name", "bench_connect_client_cpp"},
+                {"multiplex", (bool)cmd_["multiplex"]},
+                {
+                    "types",
+                    {
+                        nrpc_cpp::type<HelloRequest>(),
+                        nrpc_cpp::type<HelloResponse>(),
+                        nrpc_cpp::service<HelloService>()
+                    }
+                }
+            }));
+            // clang-format on
+
+            client->connect("127.0.0.1", (int)cmd_["port"], true, (bool)cmd_["sync"]);
+            auto connected = std::chrono::steady_clock::now();
+
+            HelloRequest req;
+            req.name = "bench";
+            req.value = j;
+            auto res = client->server_call("HelloService.Hello", req, std::shared_ptr<HelloResponse>());
+            assert(res.echo.value == j);
+            auto called = std::chrono::steady_clock::now();
+
+            client->close();
+
+            connect_ms.push_back(std::chrono::duration<double, std::milli>(connected - started).count());
+            first_call_ms.push_back(std::chrono::duration<double, std::milli>(called - started).count());
+        }
+
+        _print("connect", connect_ms);
+        _print("connect+first call", first_call_ms);
+
+        sock_->close();
+    }
+
+    /** HelloService's method */
+    HelloResponse Hello(HelloRequest req) {
+        HelloResponse resp;
+        resp.summary = "bench";
+        resp.echo = req;
+        return resp;
+    }
+
+private:
+    void _print(std::string name, std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        auto total = 0.0;
+        for (auto value : values) {
+            total += value;
+        }
+        std::cout << boost::str(boost::format("%1%: count=%2% min=%3$.2fms median=%4$.2fms max=%5$.2fms avg=%6$.2fms") %
+                                name % values.size() % values.front() % values[values.size() / 2] % values.back() %
+                                (total / values.size()))
+                  << std::endl;
+    }
+
+    nrpc_cpp::CommandLine cmd_;
+    std::shared_ptr<nrpc_cpp::RoutingSocket> sock_;
+};
+
+int main(int argc, char* argv[]) {
+    nrpc_cpp::init(argc, argv);
+    BenchApplication app;
+    app.bind();
+    app.main_loop();
+    return 0;
+}
@@ -36,6 +36,18 @@ public:
         std::cout << "CONV " << nrpc_cpp::construct_json(z) << std::endl;
         auto z2 = nrpc_cpp::construct_item<TestClass>(y);
         std::cout << "CONV " << nrpc_cpp::construct_json(z2) << std::endl;
+        std::vector<uint8_t> b;
+        TestClass z3;
+        nrpc_cpp::assign_binary(nrpc_cpp::type<TestClass>(), reinterpret_cast<uint8_t*>(&x), 0, sizeof(x), b, 1);
+        nrpc_cpp::assign_binary(nrpc_cpp::type<TestClass>(), reinterpret_cast<uint8_t*>(&z3), 0, sizeof(x), b, 0);
+        std::cout << "BINARY size=" << b.size() << ", json_size=" << y.dump().size() << ", "
+                  << nrpc_cpp::construct_json(z3) << std::endl;
+        std::vector<uint8_t> b2;
+        TestClass z4;
+        nrpc_cpp::assign_static_binary(x, b2, 1);
+        nrpc_cpp::assign_static_binary(z4, b2, 0);
+        std::cout << "STATIC size=" << b2.size() << ", "
+                  << nrpc_cpp::construct_json(z4) << std::endl;
     }
 };
 
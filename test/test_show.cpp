@@ -10,6 +10,10 @@
  *          main_loop
  *          Hello
  *          Hello2
+ *          Hello3
+ *          Hello4
+ *          Hello5
+ *          Hello6
  */
 #include "../src/nrpc_cpp.hpp"
 
@@ -28,11 +32,16 @@ public:
     HelloRequest echo;
 };
 
-$rpcclass(HelloService, $method(Hello, 1), $method(Hello2, 2));
+$rpcclass(HelloService, $method(Hello, 1), $method(Hello2, 2), $method(Hello3, 3), $method(Hello4, 4), $method(Hello5, 5),
+          $method(Hello6, 6));
 class HelloService {
 public:
     HelloResponse Hello(HelloRequest request) { return HelloResponse(); }
     nlohmann::json Hello2(nlohmann::json request) { return {}; }
+    nlohmann::json Hello3(nlohmann::json request) { return {}; }
+    HelloResponse Hello4(const HelloRequest& request) { return HelloResponse(); }
+    HelloResponse Hello5(HelloRequest&& request) { return HelloResponse(); }
+    void Hello6(const HelloRequest& request, HelloResponse& response) {}
 };
 
 class ServerApplication {
@@ -43,6 +52,7 @@ public:
             {"format", "json"},
             {"rate", 1.0},
             {"verbose", true},
+            {"workers", 0},
         });
     }
 
@@ -55,6 +65,7 @@ public:
             {"protocol", nrpc_cpp::ProtocolType::TCP},
             {"format", (std::string)cmd_["format"] == "json" ? nrpc_cpp::FormatType::JSON : nrpc_cpp::FormatType::BINARY},
             {"name", "test_show_cpp"},
+            {"workers", (int)cmd_["workers"]},
             {
                 "types",
                 {
@@ -78,15 +89,10 @@ public:
 
         // while (true) {
         //     std::this_thread::sleep_for(std::chrono::milliseconds((int)(1000 / (float)cmd_["rate"])));
-        //     std::vector<int> clients = {1, 2, 3, 4, 5, 6, 7, 8};
+        //     auto results = sock_->broadcast_call(nrpc_cpp::get_string(nrpc_cpp::RoutingMessage::GetAppInfo),
+        //                                          nlohmann::json({}), [](int client_id) { return client_id <= 8; }, 1000);
 
-        //     for (auto client_id : clients) {
-        //         auto active_ids = sock_->get_client_ids();
-        //         if (!nrpc_cpp::find_contains(active_ids, [client_id](auto x) { return x == client_id; })) {
-        //             continue;
-        //         }
-        //         auto res = sock_->client_call(client_id, nrpc_cpp::get_string(nrpc_cpp::RoutingMessage::GetAppInfo),
-        //                                     nlohmann::json({}));
+        //     for (auto& [client_id, res] : results) {
         //         if ((bool)cmd_["verbose"]) {
         //             std::cout << "Called client: GetAppInfo, " << client_id << ", " << ((std::string)res["socket_name"])
         //                     << ", " << ((std::string)res["this_socket"]) << std::endl;
@@ -115,6 +121,40 @@ public:
         };
     }
 
+    /** HelloService's method, awaitable */
+    nrpc_cpp::Task<nlohmann::json> Hello3(nlohmann::json req) {
+        std::cout << "CALL ServerApplication.Hello3, " << req.dump() << std::endl;
+        co_return nlohmann::json({
+            {"summary", "test3"},
+            {"echo", req},
+        });
+    }
+
+    /** HelloService's method, request by const reference */
+    HelloResponse Hello4(const HelloRequest& req) {
+        std::cout << "CALL ServerApplication.Hello4, name=" << req.name << ", value=" << req.value << std::endl;
+        HelloResponse resp;
+        resp.summary = "test4";
+        resp.echo = req;
+        return resp;
+    }
+
+    /** HelloService's method, request moved in */
+    HelloResponse Hello5(HelloRequest&& req) {
+        std::cout << "CALL ServerApplication.Hello5, name=" << req.name << ", value=" << req.value << std::endl;
+        HelloResponse resp;
+        resp.summary = "test5";
+        resp.echo = std::move(req);
+        return resp;
+    }
+
+    /** HelloService's method, response filled in place */
+    void Hello6(const HelloRequest& req, HelloResponse& resp) {
+        std::cout << "CALL ServerApplication.Hello6, name=" << req.name << ", value=" << req.value << std::endl;
+        resp.summary = "test6";
+        resp.echo = req;
+    }
+
 private:
     nrpc_cpp::CommandLine cmd_;
     std::shared_ptr<nrpc_cpp::RoutingSocket> sock_;
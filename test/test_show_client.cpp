@@ -8,8 +8,13 @@
  *      ClientApplication
  *          bind
  *          main_loop
+ *          hello_chain
  *          Hello
  *          Hello2
+ *          Hello3
+ *          Hello4
+ *          Hello5
+ *          Hello6
  */
 #include "../src/nrpc_cpp.hpp"
 
@@ -28,11 +33,16 @@ public:
     HelloRequest echo;
 };
 
-$rpcclass(HelloService, $method(Hello, 1), $method(Hello2, 2));
+$rpcclass(HelloService, $method(Hello, 1), $method(Hello2, 2), $method(Hello3, 3), $method(Hello4, 4), $method(Hello5, 5),
+          $method(Hello6, 6));
 class HelloService {
 public:
     HelloResponse Hello(HelloRequest request) { return HelloResponse(); }
     nlohmann::json Hello2(nlohmann::json request) { return {}; }
+    nlohmann::json Hello3(nlohmann::json request) { return {}; }
+    HelloResponse Hello4(const HelloRequest& request) { return HelloResponse(); }
+    HelloResponse Hello5(HelloRequest&& request) { return HelloResponse(); }
+    void Hello6(const HelloRequest& request, HelloResponse& response) {}
 };
 
 class HelloClient : public nrpc_cpp::ServiceClientBase {
@@ -46,6 +56,22 @@ public:
     nlohmann::json Hello2(nlohmann::json request) {
         return socket_->server_call("HelloService.Hello2", request, std::shared_ptr<nlohmann::json>());
     }
+
+    nlohmann::json Hello3(nlohmann::json request) {
+        return socket_->server_call("HelloService.Hello3", request, std::shared_ptr<nlohmann::json>());
+    }
+
+    HelloResponse Hello4(const HelloRequest& request) {
+        return socket_->server_call("HelloService.Hello4", request, std::shared_ptr<HelloResponse>());
+    }
+
+    HelloResponse Hello5(HelloRequest&& request) {
+        return socket_->server_call("HelloService.Hello5", request, std::shared_ptr<HelloResponse>());
+    }
+
+    void Hello6(const HelloRequest& request, HelloResponse& response) {
+        response = socket_->server_call("HelloService.Hello6", request, std::shared_ptr<HelloResponse>());
+    }
 };
 
 class ClientApplication {
@@ -109,11 +135,41 @@ public:
 
             auto res4 = client->Hello2({{"name", "tester4"}, {"value", 777}});
             std::cout << "SEND HelloService.Hello2, 4, " << res4 << std::endl;
+
+            auto res5 = sock_->server_call_async("HelloService.Hello", req3, std::shared_ptr<HelloResponse>());
+            auto res6 = sock_->server_call_async("HelloService.Hello2", {{"name", "tester6"}});
+            auto res5b = res5.get();
+            std::cout << "SEND HelloService.Hello, 5, " << nrpc_cpp::construct_json(res5b) << std::endl;
+            std::cout << "SEND HelloService.Hello2, 6, " << res6.get() << std::endl;
+
+            auto res8 = client->Hello4(req3);
+            std::cout << "SEND HelloService.Hello4, 8, " << nrpc_cpp::construct_json(res8) << std::endl;
+
+            auto res9 = client->Hello5(HelloRequest(req3));
+            std::cout << "SEND HelloService.Hello5, 9, " << nrpc_cpp::construct_json(res9) << std::endl;
+
+            HelloResponse res10;
+            client->Hello6(req3, res10);
+            std::cout << "SEND HelloService.Hello6, 10, " << nrpc_cpp::construct_json(res10) << std::endl;
+
+            hello_chain(req3).start([](nlohmann::json& res7, std::exception_ptr error) {
+                if (error) {
+                    std::cout << "SEND HelloService.Hello, HelloService.Hello3, 7, failed" << std::endl;
+                    return;
+                }
+                std::cout << "SEND HelloService.Hello, HelloService.Hello3, 7, " << res7 << std::endl;
+            });
         }
 
         sock_->close();
     }
 
+    nrpc_cpp::Task<nlohmann::json> hello_chain(HelloRequest req) {
+        auto res = co_await sock_->co_server_call("HelloService.Hello", req, std::shared_ptr<HelloResponse>());
+        nlohmann::json req2 = {{"name", res.summary}, {"value", res.echo.value}};
+        co_return co_await sock_->co_server_call("HelloService.Hello3", req2);
+    }
+
 private:
     nrpc_cpp::CommandLine cmd_;
     std::shared_ptr<nrpc_cpp::RoutingSocket> sock_;